@@ -20,6 +20,7 @@
 
 #ifndef APT_H
 #define APT_H
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -39,7 +40,7 @@ extern "C" {
 #define APT_API
 #endif
 
-// Maximum height of an APT image in number of rows
+// Height of the realtime image in number of rows (a PNG needs its height up front), other images grow as needed
 #define APT_MAX_HEIGHT 3000
 // Width in pixels of sync
 #define APT_SYNC_WIDTH 39
@@ -81,27 +82,132 @@ typedef enum apt_channel {
 
 // Width in elements of apt_image_t.prow arrays
 #define APT_PROW_WIDTH 2150
+// Distance in elements between rows of a float apt_image_t chunk, APT_PROW_WIDTH rounded up to whole 64 byte cache lines
+#define APT_IMAGE_STRIDE 2160
+// Number of rows in each chunk of an apt_image_t
+#define APT_IMAGE_CHUNK 256
 
 // apt_getpixelrow callback function to get audio samples.
 // context is the same as passed to apt_getpixelrow.
 typedef int (*apt_getsamples_t)(void *context, float *samples, int count);
 
+// apt_decoder_push_samples callback for each finished row, row holds APT_IMG_WIDTH pixels and is only valid until
+// the callback returns. zenith is the row of closest approach so far, see apt_decoder_getpixelrow.
+typedef void (*apt_row_callback_t)(void *context, const float *row, int nrow, int zenith);
+
+// Decoder state for a single stream, see apt_decoder_create
+typedef struct apt_decoder apt_decoder_t;
+
+// Information about the last row returned by a decoder
 typedef struct {
-    float *prow[APT_MAX_HEIGHT];  // Row buffers
-    int nrow;                     // Number of rows
-    int zenith;                   // Row in image where satellite reaches peak elevation
-    apt_channel_t chA, chB;       // ID of each channel
-    char name[256];               // Stripped filename
-    char *palette;                // Filename of palette
+    int sync_offset;        // Pixels skipped to line the row up with the sync marker, 0 when already aligned
+    float sync_confidence;  // Normalized correlation of the sync marker(s), from -1 to 1
+    double time;            // Start of the row in seconds since the start of the stream
+    float line_rate;        // Estimated drift of the sync marker in pixels per row, follows doppler
+} apt_row_info_t;
+
+// Storage of the pixels of an apt_image_t. Calibrated images only hold values from 0 to 255, so they can be
+// compacted to 16 bit (8.8 fixed point) or 8 bit pixels with apt_image_compact.
+typedef enum apt_format {
+    APT_FORMAT_FLOAT,
+    APT_FORMAT_U16,
+    APT_FORMAT_U8
+} apt_format_t;
+
+typedef struct {
+    float **prow;            // Row buffers, pointing into chunks, NULL unless format is APT_FORMAT_FLOAT (stored unflipped)
+    int nrow;                // Number of rows
+    int zenith;              // Row in image where satellite reaches peak elevation
+    apt_channel_t chA, chB;  // ID of each channel
+    char name[256];          // Stripped filename
+    char *palette;           // Filename of palette
+    void **chunks;           // APT_IMAGE_CHUNK rows each, whole cache lines apart and 64 byte aligned, see apt_image_alloc
+    int capacity;            // Number of rows in chunks
+    apt_format_t format;     // Pixel format of chunks
+    int flipped;             // Channels are turned half a turn when read, see apt_image_flip
 } apt_image_t;
 
 typedef struct {
     float r, g, b;
 } apt_rgb_t;
 
+// Whole image effects for apt_image_process
+typedef enum apt_stage {
+    APT_STAGE_DENOISE,   // apt_denoise
+    APT_STAGE_FLIP,      // apt_image_flip
+    APT_STAGE_LINEAR,    // apt_linearEnhance
+    APT_STAGE_HISTOGRAM  // apt_histogramEqualise
+} apt_stage_t;
+
+// Create a decoder for a stream, returns NULL if the sample rate is not supported. Rates
+// above 62400Hz are decimated by a power of 2 first, up to about 16MHz.
+// Separate decoders share no state, so each can be run on its own thread.
+apt_decoder_t APT_API *apt_decoder_create(double sample_rate);
+void APT_API apt_decoder_free(apt_decoder_t *dec);
+// Use a table driven PLL, much faster on high sample rate inputs with a
+// phase error of less than 2e-5 rad compared to the default one
+void APT_API apt_decoder_set_fast_pll(apt_decoder_t *dec, int enable);
+// Set the number of phases of the pixel resampler (256 by default), more
+// phases give finer sub-pixel timing at the cost of memory
+int APT_API apt_decoder_set_resampler_phases(apt_decoder_t *dec, int phases);
+// Also use the sync B marker of channel B when searching for the start of a row
+void APT_API apt_decoder_set_sync_b(apt_decoder_t *dec, int enable);
+int APT_API apt_decoder_getpixelrow(apt_decoder_t *dec, float *pixelv, int nrow, int *zenith, int reset, apt_getsamples_t getsamples,
+                                    void *context);
+void APT_API apt_decoder_get_row_info(const apt_decoder_t *dec, apt_row_info_t *info);
+// Decode up to max_rows rows into one block, row i starting at dst + i * stride (at least APT_IMG_WIDTH), with
+// nrow being the number of the first. Returns the number of rows decoded, which is less than max_rows once
+// getsamples runs out. If info isn't NULL it gets the alignment and timing of each row.
+int APT_API apt_decoder_getpixelrows(apt_decoder_t *dec, float *dst, size_t stride, int max_rows, int nrow, int *zenith,
+                                     apt_row_info_t *info, apt_getsamples_t getsamples, void *context);
+
+// The decoder can also be split in two, for example to run each half on its own thread. apt_decoder_demodulate
+// only runs the front end (decimation, Hilbert transform and PLL), reading samples and writing up to count AM
+// amplitude samples. A second decoder created with the same sample rate and set to demodulated input then
+// reads those amplitude samples from its getsamples callback in apt_decoder_getpixelrow.
+int APT_API apt_decoder_demodulate(apt_decoder_t *dec, float *amplitude, int count, apt_getsamples_t getsamples,
+                                   void *context);
+void APT_API apt_decoder_set_demodulated_input(apt_decoder_t *dec, int enable);
+
+// Push API, as an alternative to pulling samples through apt_getsamples_t. Once a row callback is set, samples
+// can be given to apt_decoder_push_samples as they arrive (for example from a radio or audio thread), which
+// calls back for each row finished. Pushing never allocates, locks or waits, samples that are not enough for a
+// row yet are kept in the decoder. apt_decoder_set_row_callback returns 0 if it couldn't allocate the row buffer.
+int APT_API apt_decoder_set_row_callback(apt_decoder_t *dec, apt_row_callback_t callback, void *context);
+void APT_API apt_decoder_push_samples(apt_decoder_t *dec, const float *samples, size_t count);
+
+// Single stream API, uses a decoder internal to the library
 int APT_API apt_init(double sample_rate);
 int APT_API apt_getpixelrow(float *pixelv, int nrow, int *zenith, int reset, apt_getsamples_t getsamples, void *context);
 
+// Allocate room for rows rows in an image, returns 0 on failure. Rows are kept in chunks of APT_IMAGE_CHUNK, with
+// prow pointing at each. Only the buffers are touched, so the rest of img can be copied from another image first.
+int APT_API apt_image_alloc(apt_image_t *img, int rows);
+// Make room for at least rows rows, adding chunks without moving the rows already there (prow itself can move)
+int APT_API apt_image_reserve(apt_image_t *img, int rows);
+void APT_API apt_image_free(apt_image_t *img);
+// Allocate dst and copy the rows of src into it, in the same format. Returns 0 on failure.
+int APT_API apt_image_copy(apt_image_t *dst, const apt_image_t *src);
+// Convert a float image to a compact format, clipping pixels to 0-255. Returns 0 if img isn't a float image (unless
+// format is its own). After this only the apt_image_* functions below can read the pixels, prow is all NULL.
+int APT_API apt_image_compact(apt_image_t *img, apt_format_t format);
+// Get row y as floats, either the row itself (unflipped float images) or a conversion into buf (APT_PROW_WIDTH floats)
+float APT_API *apt_image_load_row(const apt_image_t *img, int y, float *buf);
+// Write back pixels offset to offset+width of a row returned by apt_image_load_row
+void APT_API apt_image_store_row(apt_image_t *img, int y, const float *row, int offset, int width);
+// Turn both channels half a turn, for northbound passes. No pixels are moved, rows are mapped as they are loaded
+// and stored instead, so this takes no time. The image shouldn't gain rows while flipped.
+void APT_API apt_image_flip(apt_image_t *img);
+// Move the pixels of a flipped image to where they are shown, so prow can be used directly again
+void APT_API apt_image_apply_flip(apt_image_t *img);
+void APT_API apt_image_histogramEqualise(apt_image_t *img, int offset, int width);
+void APT_API apt_image_linearEnhance(apt_image_t *img, int offset, int width);
+void APT_API apt_image_denoise(apt_image_t *img, int offset, int width);
+// Run a list of effects on both channels, in order. Same as calling each effect in turn, but the image is only swept
+// once plus once per equalise. Rows are split between up to threads threads. Returns 0 if a stage is unknown or
+// memory runs out.
+int APT_API apt_image_process(apt_image_t *img, const apt_stage_t *stages, int nstages, int threads);
+
 void APT_API apt_histogramEqualise(float **prow, int nrow, int offset, int width);
 void APT_API apt_linearEnhance(float **prow, int nrow, int offset, int width);
 apt_channel_t APT_API apt_calibrate(float **prow, int nrow, int offset, int width);
@@ -113,6 +219,27 @@ void APT_API apt_calibrate_visible(int satnum, apt_image_t *img, int offset, int
 // Moved to apt_calibrate_thermal
 #define apt_temperature apt_calibrate_thermal
 
+/* Telemetry tracked a row at a time, so a pass can be calibrated while it's still being decoded (apt_calibrate
+ * needs the whole image). Rows pushed in come back out a frame (APT_FRAME_LEN rows, 64 seconds) later with both
+ * channels brightness calibrated with the best frame so far, as they would be by apt_calibrate. Until a frame has
+ * been found rows are held back for up to 3 frames, and then given out as they are.
+ */
+typedef struct apt_telemetry apt_telemetry_t;
+
+// Returns NULL if out of memory, satnum is used by the temperature and visible calibration
+apt_telemetry_t APT_API *apt_telemetry_create(int satnum);
+void APT_API apt_telemetry_free(apt_telemetry_t *tel);
+// Add the next row (APT_PROW_WIDTH floats) of a pass. Returns 1 if a row came out into out.
+int APT_API apt_telemetry_push_row(apt_telemetry_t *tel, const float *row, float *out);
+// Give out the rows still held back at the end of a pass, one per call, returns 0 once there are none left
+int APT_API apt_telemetry_flush(apt_telemetry_t *tel, float *out);
+// Channel IDs read from the best frames so far, APT_CHANNEL_UNKNOWN until one is found
+void APT_API apt_telemetry_get_channels(const apt_telemetry_t *tel, apt_channel_t *chA, apt_channel_t *chB);
+// Temperature (channel B) or visible (channel A) calibrate a row given out by the tracker, like apt_calibrate_thermal
+// and apt_calibrate_visible. Returns 0 and leaves the row as it is if the channel isn't one that can be.
+int APT_API apt_telemetry_calibrate_thermal(const apt_telemetry_t *tel, float *row);
+int APT_API apt_telemetry_calibrate_visible(const apt_telemetry_t *tel, float *row);
+
 apt_rgb_t APT_API apt_applyPalette(char *palette, int val);
 apt_rgb_t APT_API apt_RGBcomposite(apt_rgb_t top, float top_a, apt_rgb_t bottom, float bottom_a);
 
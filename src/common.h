@@ -36,6 +36,11 @@ typedef struct {
     char *filename;  // Output filename
     char *palette;   // Filename of palette
     float gamma;     // Gamma
+    int fast_pll;    // Use the approximate PLL
+    int pipeline;    // Decode on separate threads
+    int stream;      // Write images as the pass is decoded, when they allow it
+    int jobs;        // Number of threads, for decoding segments and effects
+    int bits;        // Bits per pixel kept after calibration, 0 for floats
 } options_t;
 
 enum imagetypes {
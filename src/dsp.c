@@ -21,14 +21,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <complex.h>
+#include <stdint.h>
 
 #include "apt.h"
+#include "fft.h"
 #include "filter.h"
+#include "ring.h"
 #include "taps.h"
 #include "util.h"
 
-// Block sizes
-#define BLKAMP 32768
+// Block sizes, BLKAMP holds the amplitude for the longest possible row (see push_row_ready)
+#define BLKAMP 65536
 #define BLKIN 32768
 
 #define CARRIER_FREQ 2400.0
@@ -37,38 +40,268 @@
 #define RSMULT 15
 #define Fi (APT_IMG_WIDTH * 2 * RSMULT)
 
-static float _sample_rate;
+// Analytic signal front end, each FFT turns 2 * HILBERT_BLOCK input samples into I/Q, see hilbert_block
+#define HILBERT_FFT_SIZE 1024
+#define HILBERT_SPAN ((int)HILBERT_FILTER_SIZE * 2 - 1)
+#define HILBERT_BLOCK (HILBERT_FFT_SIZE - HILBERT_SPAN + 1)
+#define HILBERT_WINDOW (2 * HILBERT_BLOCK + HILBERT_SPAN - 1)  // Input samples read by one block
+
+// Decimation of high sample rate inputs, each stage halves the sample rate, see decimate
+#define MAX_DECIMATION_STAGES 8
+#define DECIMATION_BUFFER 4096
+
+// Default number of phases of the resampling filter bank
+#define RESAMPLER_PHASES 256
+
+// Size of the FFT used to search for the sync marker, must fit a row plus the sync pattern
+#define SYNC_FFT_SIZE 4096
+// Distance from the start of sync A (as correlated) to the first pulse of sync B
+#define SYNC_B_OFFSET (APT_CH_OFFSET + 3)
+
+// Sync tracking loop, see apt_decoder_getpixelrow
+#define SYNC_TRACK_WINDOW 3        // Pixels either side of the predicted position that are searched
+#define SYNC_TRACK_THRESHOLD 0.5f  // Fraction of the running sync level that counts as a hit
+#define SYNC_TRACK_MISSES 4        // Consecutive misses before falling back to a full search
+#define SYNC_TRACK_ALPHA 0.25f     // Proportional gain, fraction of the timing error corrected per row
+#define SYNC_TRACK_BETA 0.015f     // Integral gain of the line rate estimate, about ALPHA^2/4 for critical damping
+#define SYNC_LOCK_ROWS 8           // Aligned rows needed before switching from full searches to tracking
+
+// Size of the cosine table used by the fast PLL, the 32 bit phase accumulator
+// is split into a table index and a fraction used to interpolate between entries
+#define NCO_BITS 10
+#define NCO_SIZE (1 << NCO_BITS)
+#define NCO_FRAC_BITS (32 - NCO_BITS)
+
+struct apt_decoder {
+    float sample_rate;  // After decimation
+    const filter_kernels_t *kernels;
+
+    // PLL state
+    float oscillator_phase;
+    float oscillator_freq;
+    float pll_alpha;
+    float pll_beta;
+
+    // getsamples gives AM amplitude instead of raw samples, see apt_decoder_demodulate
+    int demodulated_input;
+
+    // Fast PLL state, see pll_fast
+    int fast_pll;
+    uint32_t nco_phase;
+    float nco_table[NCO_SIZE + 1];
+
+    // Decimation stages for inputs above Fi, first stage is closest to the input.
+    // Each one holds the input that has not been filtered yet.
+    mirror_t *halfband;
+    int decimation_stages;
+
+    // Input sample buffer
+    mirror_t inbuff;
+
+    // Analytic signal, hilbert_filter_fft holds the spectrum of the quadrature filter
+    fft_plan_t *hilbert_plan;
+    float *hilbert_filter_fft;
+    float *hilbert_buf;
+    complexf_t iqbuff[2 * HILBERT_BLOCK];
+    int idxiq;
+    int niq;
+
+    // Amplitude buffer and sub-sample offset of the next pixel
+    mirror_t ampbuff;
+    float offset;
+    float FreqLine;
+    double amp_position;  // Amplitude samples consumed since the decoder was created
+
+    // Polyphase resampler, nphases + 1 rows of ntaps coefficients
+    float *resampler;
+    int nphases;
+    int ntaps;
+
+    // Row assembly and sync state
+    float pixels[APT_IMG_WIDTH + SYNC_PATTERN_SIZE];
+    size_t npv;
+    int synced;
+    float max;
+
+    // Sync tracking loop, line_rate is the estimated drift of the sync marker in pixels per row
+    int locked;
+    int sync_misses;
+    float sync_level;
+    float line_rate;
+    float sync_tail[SYNC_TRACK_WINDOW];  // End of the previous row, for sync markers that arrive early
+    float minDoppler;
+    float previous;
+    int lastmshift;
+
+    // FFT sync search, sync_filter holds the spectrum of sync A with sync B in the imaginary part
+    fft_plan_t *sync_plan;
+    float *sync_filter;
+    float *sync_buf;
+    int sync_b;
+
+    // Alignment and timing of the last row
+    int sync_offset;
+    float sync_confidence;
+    double row_time;
+
+    // Push API, samples given to apt_decoder_push_samples that have not been read yet
+    const float *push_samples;
+    size_t push_count;
+    apt_row_callback_t row_callback;
+    void *row_context;
+    float *push_row;
+    int push_nrow;
+    int push_zenith;
+};
+
+// Create a decoder for a stream at the given sample rate
+apt_decoder_t *apt_decoder_create(double sample_rate) {
+    if (sample_rate > Fi * (1 << MAX_DECIMATION_STAGES) || sample_rate < APT_IMG_WIDTH * 2) return NULL;
+
+    apt_decoder_t *dec = (apt_decoder_t *)calloc(1, sizeof(apt_decoder_t));
+    if (dec == NULL) return NULL;
+    dec->kernels = filter_get_kernels();
+
+    // Halve the sample rate until it is supported
+    while (sample_rate > Fi) {
+        sample_rate /= 2.0;
+        dec->decimation_stages++;
+    }
+    dec->sample_rate = sample_rate;
 
-static float offset = 0.0;
-static float FreqLine = 1.0;
+    // Pll configuration
+    dec->pll_alpha = 50 / dec->sample_rate;
+    dec->pll_beta = dec->pll_alpha * dec->pll_alpha / 2.0;
+    dec->oscillator_freq = CARRIER_FREQ / sample_rate;
+    for (int i = 0; i <= NCO_SIZE; i++) {
+        dec->nco_table[i] = cos(M_TAUf * i / NCO_SIZE);
+    }
 
-static float oscillator_freq;
-static float pll_alpha;
-static float pll_beta;
+    dec->FreqLine = 1.0;
+    dec->minDoppler = 1000000000;
+
+    dec->sync_plan = fft_plan_create(SYNC_FFT_SIZE);
+    dec->sync_filter = (float *)malloc(sizeof(float) * 2 * SYNC_FFT_SIZE);
+    dec->sync_buf = (float *)malloc(sizeof(float) * 2 * SYNC_FFT_SIZE);
+    dec->hilbert_plan = fft_plan_create(HILBERT_FFT_SIZE);
+    dec->hilbert_filter_fft = (float *)calloc(2 * HILBERT_FFT_SIZE, sizeof(float));
+    dec->hilbert_buf = (float *)malloc(sizeof(float) * 2 * HILBERT_FFT_SIZE);
+    dec->halfband = (mirror_t *)calloc(dec->decimation_stages, sizeof(mirror_t));
+    int buffers = (dec->decimation_stages == 0 || dec->halfband != NULL);
+    for (int i = 0; i < dec->decimation_stages && buffers; i++) {
+        buffers = mirror_init(&dec->halfband[i], DECIMATION_BUFFER, HALFBAND_FILTER_SIZE);
+    }
+    buffers = buffers && mirror_init(&dec->inbuff, BLKIN, HILBERT_WINDOW) && mirror_init(&dec->ampbuff, BLKAMP, LOW_PASS_SIZE);
+    if (!buffers || dec->sync_plan == NULL || dec->sync_filter == NULL || dec->sync_buf == NULL ||
+        dec->hilbert_plan == NULL || dec->hilbert_filter_fft == NULL || dec->hilbert_buf == NULL ||
+        !apt_decoder_set_resampler_phases(dec, RESAMPLER_PHASES)) {
+        apt_decoder_free(dec);
+        return NULL;
+    }
+    apt_decoder_set_sync_b(dec, 0);
 
-// Initalise and configure PLL
-int apt_init(double sample_rate) {
-    if (sample_rate > Fi) return 1;
-    if (sample_rate < APT_IMG_WIDTH * 2) return -1;
-    _sample_rate = sample_rate;
+    // The quadrature filter only has taps on every other sample, same as hilbert_transform
+    for (size_t i = 0; i < HILBERT_FILTER_SIZE; i++) {
+        dec->hilbert_filter_fft[4 * i] = hilbert_filter[i];
+    }
+    fft_forward(dec->hilbert_plan, dec->hilbert_filter_fft);
 
-    // Pll configuration
-    pll_alpha = 50 / _sample_rate;
-    pll_beta = pll_alpha * pll_alpha / 2.0;
-    oscillator_freq = CARRIER_FREQ / sample_rate;
+    return dec;
+}
 
-    return 0;
+void apt_decoder_free(apt_decoder_t *dec) {
+    if (dec == NULL) return;
+    for (int i = 0; i < dec->decimation_stages && dec->halfband != NULL; i++) mirror_free(&dec->halfband[i]);
+    free(dec->halfband);
+    mirror_free(&dec->inbuff);
+    mirror_free(&dec->ampbuff);
+    free(dec->push_row);
+    free(dec->resampler);
+    fft_plan_free(dec->sync_plan);
+    free(dec->sync_filter);
+    free(dec->sync_buf);
+    fft_plan_free(dec->hilbert_plan);
+    free(dec->hilbert_filter_fft);
+    free(dec->hilbert_buf);
+    free(dec);
+}
+
+void apt_decoder_get_row_info(const apt_decoder_t *dec, apt_row_info_t *info) {
+    info->sync_offset = dec->sync_offset;
+    info->sync_confidence = dec->sync_confidence;
+    info->time = dec->row_time;
+    info->line_rate = dec->line_rate;
+}
+
+/* Precompute the spectrum of the sync patterns. Both correlations are real,
+ * so they can share one inverse FFT as A + iB, see sync_search. Since
+ * X * conj(FFT(a)) + i * X * conj(FFT(b)) == X * conj(FFT(a - ib)), the
+ * filter is the transform of sync A with the negated sync B as the
+ * imaginary part.
+ */
+void apt_decoder_set_sync_b(apt_decoder_t *dec, int enable) {
+    float *filter = dec->sync_filter;
+    for (size_t i = 0; i < 2 * SYNC_FFT_SIZE; i++) filter[i] = 0.0f;
+
+    for (size_t i = 0; i < SYNC_PATTERN_SIZE; i++) filter[2 * i] = sync_pattern[i];
+    if (enable) {
+        for (size_t i = 0; i < SYNC_B_PATTERN_SIZE; i++) filter[2 * i + 1] = -sync_b_pattern[i];
+    }
+    fft_forward(dec->sync_plan, filter);
+
+    dec->sync_b = enable;
 }
 
-static float pll(complexf_t in) {
-    static float oscillator_phase = 0.0;
+/* Build the filter bank used to resample amplitude into pixels, row p holds
+ * the low pass filter sampled at a sub-sample offset of p / nphases, scaled
+ * by the resampling factor. Doppler correction (FreqLine) only changes which
+ * row is picked for each pixel, see getpixelv.
+ */
+int apt_decoder_set_resampler_phases(apt_decoder_t *dec, int phases) {
+    if (phases < 1) return 0;
+
+    float mult = (float)Fi / dec->sample_rate;
+    int ntaps = (int)ceilf((LOW_PASS_SIZE - 1) / mult - 1);
+
+    float *resampler = (float *)malloc(sizeof(float) * (phases + 1) * ntaps);
+    if (resampler == NULL) return 0;
+
+    for (int p = 0; p <= phases; p++) {
+        for (int i = 0; i < ntaps; i++) {
+            float n = mult * (i + (float)p / phases);
+            int k = (int)floor(n);
+            float alpha = n - k;
 
+            resampler[p * ntaps + i] = (low_pass[k] * (1.0f - alpha) + low_pass[k + 1] * alpha) * mult * 256.0f;
+        }
+    }
+
+    free(dec->resampler);
+    dec->resampler = resampler;
+    dec->nphases = phases;
+    dec->ntaps = ntaps;
+    return 1;
+}
+
+void apt_decoder_set_demodulated_input(apt_decoder_t *dec, int enable) { dec->demodulated_input = enable; }
+
+// Switch between the two PLL implementations, carrying over the oscillator phase
+void apt_decoder_set_fast_pll(apt_decoder_t *dec, int enable) {
+    if (enable && !dec->fast_pll) {
+        dec->nco_phase = (uint32_t)(int64_t)(dec->oscillator_phase / M_TAUf * 4294967296.0);
+    } else if (!enable && dec->fast_pll) {
+        dec->oscillator_phase = remainderf(dec->nco_phase / 4294967296.0 * M_TAUf, M_TAUf);
+    }
+    dec->fast_pll = enable;
+}
+
+static float pll(apt_decoder_t *dec, complexf_t in) {
     // Internal oscillator
 #ifdef _MSC_VER
-    complexf_t osc = _FCbuild(cos(oscillator_phase), -sin(oscillator_phase));
+    complexf_t osc = _FCbuild(cos(dec->oscillator_phase), -sin(dec->oscillator_phase));
     in = _FCmulcc(in, osc);
 #else
-    complexf_t osc = cos(oscillator_phase) + -sin(oscillator_phase) * I;
+    complexf_t osc = cos(dec->oscillator_phase) + -sin(dec->oscillator_phase) * I;
     in *= osc;
 #endif
 
@@ -76,183 +309,527 @@ static float pll(complexf_t in) {
     float error = cargf(in);
 
     // Adjust frequency and phase
-    oscillator_freq += pll_beta * error;
-    oscillator_freq = clamp_half(oscillator_freq, (CARRIER_FREQ + MAX_CARRIER_OFFSET) / _sample_rate);
-    oscillator_phase += M_TAUf * (pll_alpha * error + oscillator_freq);
-    oscillator_phase = remainderf(oscillator_phase, M_TAUf);
+    dec->oscillator_freq += dec->pll_beta * error;
+    dec->oscillator_freq = clamp_half(dec->oscillator_freq, (CARRIER_FREQ + MAX_CARRIER_OFFSET) / dec->sample_rate);
+    dec->oscillator_phase += M_TAUf * (dec->pll_alpha * error + dec->oscillator_freq);
+    dec->oscillator_phase = remainderf(dec->oscillator_phase, M_TAUf);
 
     return crealf(in);
 }
 
-// Convert samples into pixels
-static int getamp(float *ampbuff, int count, apt_getsamples_t getsamples, void *context) {
-    static float inbuff[BLKIN];
-    static int idxin = 0;
-    static int nin = 0;
+// Cosine of a phase in 2^32 units, by linear interpolation of the table
+static float nco_cos(const apt_decoder_t *dec, uint32_t phase) {
+    uint32_t i = phase >> NCO_FRAC_BITS;
+    float frac = (phase & ((1u << NCO_FRAC_BITS) - 1)) * (1.0f / (1u << NCO_FRAC_BITS));
+    return dec->nco_table[i] + frac * (dec->nco_table[i + 1] - dec->nco_table[i]);
+}
 
-    for (int n = 0; n < count; n++) {
+// Polynomial atan2, Abramowitz and Stegun 4.4.47, error of the polynomial is less than 1e-5 rad
+static float fast_atan2(float y, float x) {
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    if (ax == 0.0f && ay == 0.0f) return 0.0f;
 
-        // Get some more samples when needed
-        if (nin < HILBERT_FILTER_SIZE * 2 + 2) {
-            // Number of samples read
-            int res;
-            memmove(inbuff, &(inbuff[idxin]), nin * sizeof(float));
-            idxin = 0;
+    float a = (ay > ax) ? ax / ay : ay / ax;
+    float s = a * a;
+    float r = a * (0.9998660f + s * (-0.3302995f + s * (0.1801410f + s * (-0.0851330f + s * 0.0208351f))));
 
-            // Read some samples
-            res = getsamples(context, &(inbuff[nin]), BLKIN - nin);
-            nin += res;
+    if (ay > ax) r = M_PIf / 2.0f - r;
+    if (x < 0.0f) r = M_PIf - r;
+    return (y < 0.0f) ? -r : r;
+}
 
-            // Make sure there is enough samples to continue
-            if (nin < HILBERT_FILTER_SIZE * 2 + 2) return n;
+/* Same loop as pll(), but with a table driven NCO and a polynomial phase
+ * detector instead of cos/sin/cargf/remainderf. The oscillator has an error
+ * of at most 5e-6 (linear interpolation over 1024 steps) and the phase
+ * detector at most 1.2e-5 rad (including float rounding), so the phase error
+ * compared to pll() stays below 2e-5 rad (0.001 degrees), far below the
+ * noise of any real signal.
+ */
+static float pll_fast(apt_decoder_t *dec, complexf_t in) {
+    float c = nco_cos(dec, dec->nco_phase);
+    float s = nco_cos(dec, dec->nco_phase - (1u << 30));  // sin(x) = cos(x - pi/2)
+
+    // Multiply by the conjugate of the oscillator
+    float re = crealf(in) * c + cimagf(in) * s;
+    float im = cimagf(in) * c - crealf(in) * s;
+
+    // Error detector
+    float error = fast_atan2(im, re);
+
+    // Adjust frequency and phase, wrapping of the accumulator takes care of the remainder
+    dec->oscillator_freq += dec->pll_beta * error;
+    dec->oscillator_freq = clamp_half(dec->oscillator_freq, (CARRIER_FREQ + MAX_CARRIER_OFFSET) / dec->sample_rate);
+    dec->nco_phase += (uint32_t)(int64_t)((dec->pll_alpha * error + dec->oscillator_freq) * 4294967296.0);
+
+    return re;
+}
+
+/* Get up to count samples from a decimation stage, or straight from the input
+ * when stage is -1. Each stage low passes its input with a halfband filter and
+ * keeps every other sample, pulling more input from the stage before it as
+ * needed, so only a few thousand samples per stage are ever buffered.
+ */
+static int decimate(apt_decoder_t *dec, int stage, float *out, int count, apt_getsamples_t getsamples, void *context) {
+    if (stage < 0) return getsamples(context, out, count);
+
+    mirror_t *hb = &dec->halfband[stage];
+    int n = 0;
+    while (n < count) {
+        if (mirror_count(hb) < HALFBAND_FILTER_SIZE) {
+            int res = decimate(dec, stage - 1, mirror_tail(hb), (int)mirror_space(hb), getsamples, context);
+            if (res == 0) break;
+            mirror_commit(hb, res);
+            continue;
         }
 
-        // Process read samples into a brightness value
-        complexf_t sample = hilbert_transform(&inbuff[idxin], hilbert_filter, HILBERT_FILTER_SIZE);
-        ampbuff[n] = pll(sample);
+        for (; mirror_count(hb) >= HALFBAND_FILTER_SIZE && n < count; mirror_consume(hb, 2)) {
+            out[n++] = dec->kernels->convolve(mirror_data(hb), halfband_filter, HALFBAND_FILTER_SIZE);
+        }
+    }
+
+    return n;
+}
 
-        // Increment current sample
-        idxin++;
-        nin--;
+/* Turn a block of input samples into analytic I/Q, returns the number of
+ * samples produced. The quadrature part is done with overlap-save fast
+ * convolution. Since both the input and the filter are real, two overlapping
+ * blocks go through one FFT: the first as the real part and the second as the
+ * imaginary part. The in phase part is the center sample minus the mean over
+ * the filter span, kept as two running sums (one per parity of the index).
+ */
+static int hilbert_block(apt_decoder_t *dec, apt_getsamples_t getsamples, void *context) {
+    // Get some more samples when needed, a second time if the first read stopped at the end of the buffer
+    if (mirror_count(&dec->inbuff) < HILBERT_WINDOW) {
+        for (int pass = 0; pass < 2; pass++) {
+            int space = (int)mirror_space(&dec->inbuff);
+            int res = decimate(dec, dec->decimation_stages - 1, mirror_tail(&dec->inbuff), space, getsamples, context);
+            mirror_commit(&dec->inbuff, res);
+            if (res < space) break;
+        }
+
+        // Make sure there is enough samples to continue, pushed samples are only processed in whole blocks
+        if (mirror_count(&dec->inbuff) < (dec->row_callback ? HILBERT_WINDOW : HILBERT_SPAN)) return 0;
     }
 
+    const float *in = mirror_data(&dec->inbuff);
+    int nin = (int)MIN(mirror_count(&dec->inbuff), HILBERT_WINDOW);
+    int count = MIN(nin - HILBERT_SPAN + 1, 2 * HILBERT_BLOCK);
+
+    float *buf = dec->hilbert_buf;
+    for (int i = 0; i < HILBERT_FFT_SIZE; i++) {
+        buf[2 * i] = (i < nin) ? in[i] : 0.0f;
+        buf[2 * i + 1] = (i + HILBERT_BLOCK < nin) ? in[i + HILBERT_BLOCK] : 0.0f;
+    }
+    fft_forward(dec->hilbert_plan, buf);
+    fft_mul_conj(buf, dec->hilbert_filter_fft, HILBERT_FFT_SIZE);
+    fft_inverse(dec->hilbert_plan, buf);
+
+    float sum[2];
+    for (int i = 0; i < count; i++) {
+        if (i < 2) {
+            sum[i] = 0.0f;
+            for (int k = 0; k < HILBERT_SPAN; k += 2) sum[i] += in[i + k];
+        } else {
+            sum[i & 1] += in[i + HILBERT_SPAN - 1] - in[i - 2];
+        }
+
+        float re = in[i + HILBERT_FILTER_SIZE - 1] - sum[i & 1] / HILBERT_FILTER_SIZE;
+        float im = (i < HILBERT_BLOCK) ? buf[2 * i] : buf[2 * (i - HILBERT_BLOCK) + 1];
+#ifdef _MSC_VER
+        dec->iqbuff[i] = _FCbuild(re, im);
+#else
+        dec->iqbuff[i] = re + im * I;
+#endif
+    }
+
+    mirror_consume(&dec->inbuff, count);
+    dec->idxiq = 0;
+    dec->niq = count;
     return count;
 }
 
-// Sub-pixel offsetting
-int getpixelv(float *pvbuff, int count, apt_getsamples_t getsamples, void *context) {
-    // Amplitude buffer
-    static float ampbuff[BLKAMP];
-    static int nam = 0;
-    static int idxam = 0;
+// Convert samples into pixels
+static int getamp(apt_decoder_t *dec, float *ampbuff, int count, apt_getsamples_t getsamples, void *context) {
+    if (dec->demodulated_input) return getsamples(context, ampbuff, count);
+
+    int n = 0;
+    while (n < count) {
+        if (dec->idxiq == dec->niq && hilbert_block(dec, getsamples, context) == 0) break;
+
+        // Process a run of I/Q samples into brightness values
+        int len = MIN(count - n, dec->niq - dec->idxiq);
+        const complexf_t *iq = &dec->iqbuff[dec->idxiq];
+        for (int i = 0; i < len; i++) {
+            ampbuff[n + i] = dec->fast_pll ? pll_fast(dec, iq[i]) : pll(dec, iq[i]);
+        }
 
-    float mult;
+        n += len;
+        dec->idxiq += len;
+    }
 
-    // Gaussian resampling factor
-    mult = (float)Fi / _sample_rate * FreqLine;
-    int m = (int)(LOW_PASS_SIZE / mult + 1);
+    return n;
+}
+
+int apt_decoder_demodulate(apt_decoder_t *dec, float *amplitude, int count, apt_getsamples_t getsamples, void *context) {
+    return getamp(dec, amplitude, count, getsamples, context);
+}
+
+// Sub-pixel offsetting
+static int getpixelv(apt_decoder_t *dec, float *pvbuff, int count, apt_getsamples_t getsamples, void *context) {
+    // Number of amplitude samples per pixel, offset is kept as a fraction of an amplitude sample
+    float step = RSMULT / ((float)Fi / dec->sample_rate * dec->FreqLine);
 
     for (int n = 0; n < count; n++) {
         int shift;
 
-        if (nam < m) {
-            int res;
-            memmove(ampbuff, &(ampbuff[idxam]), nam * sizeof(float));
-            idxam = 0;
-            res = getamp(&(ampbuff[nam]), BLKAMP - nam, getsamples, context);
-            nam += res;
-            if (nam < m) return n;
+        if (mirror_count(&dec->ampbuff) < (size_t)dec->ntaps) {
+            for (int pass = 0; pass < 2; pass++) {
+                int space = (int)mirror_space(&dec->ampbuff);
+                int res = getamp(dec, mirror_tail(&dec->ampbuff), space, getsamples, context);
+                mirror_commit(&dec->ampbuff, res);
+                if (res < space) break;
+            }
+            if (mirror_count(&dec->ampbuff) < (size_t)dec->ntaps) return n;
         }
 
-        pvbuff[n] = interpolating_convolve(&(ampbuff[idxam]), low_pass, LOW_PASS_SIZE, offset, mult) * mult * 256.0;
+        int phase = (int)(dec->offset * dec->nphases + 0.5f);
+        pvbuff[n] = dec->kernels->convolve(mirror_data(&dec->ampbuff), &dec->resampler[phase * dec->ntaps], dec->ntaps);
 
-        shift = ((int)floor((RSMULT - offset) / mult)) + 1;
-        offset = shift * mult + offset - RSMULT;
+        shift = ((int)floor(step - dec->offset)) + 1;
+        dec->offset = shift + dec->offset - step;
 
-        idxam += shift;
-        nam -= shift;
+        mirror_consume(&dec->ampbuff, shift);
+        dec->amp_position += shift;
     }
 
     return count;
 }
 
-// Get an entire row of pixels, aligned with sync markers
-int apt_getpixelrow(float *pixelv, int nrow, int *zenith, int reset, apt_getsamples_t getsamples, void *context) {
-    static float pixels[APT_IMG_WIDTH + SYNC_PATTERN_SIZE];
-    static size_t npv;
-    static int synced = 0;
-    static float max = 0.0;
-    static float minDoppler = 1000000000, previous = 0;
+// Normalized correlation of a window of pixels with a zero mean pattern, from -1 to 1
+static float pattern_confidence(const float *x, const float *pattern, size_t len) {
+    float sum = 0.0f, sumsq = 0.0f, dot = 0.0f, energy = 0.0f;
+    for (size_t i = 0; i < len; i++) {
+        sum += x[i];
+        sumsq += x[i] * x[i];
+        dot += x[i] * pattern[i];
+        energy += pattern[i] * pattern[i];
+    }
 
-    if (reset) synced = 0;
+    float variance = sumsq - sum * sum / len;
+    if (variance <= 0.0f) return 0.0f;
+    return dot / sqrtf(variance * energy);
+}
 
-    float corr, ecorr, lcorr;
-    int res;
+// Confidence in the alignment of a row
+static float sync_confidence(const apt_decoder_t *dec, const float *pixelv) {
+    float confidence = pattern_confidence(&pixelv[1], sync_pattern, SYNC_PATTERN_SIZE);
+    if (dec->sync_b) {
+        confidence += pattern_confidence(&pixelv[1 + SYNC_B_OFFSET], sync_b_pattern, SYNC_B_PATTERN_SIZE);
+        confidence /= 2.0f;
+    }
 
-    // Move the row buffer into the the image buffer
-    if (npv > 0) memmove(pixelv, pixels, npv * sizeof(float));
+    return confidence;
+}
+
+/* Find the shift that best aligns the sync marker with an FFT cross-correlation
+ * of the whole row, instead of correlating at every position. Returns the
+ * shift and the sync A correlation at that shift.
+ */
+static int sync_search(apt_decoder_t *dec, const float *pixelv, size_t npv, float *corr) {
+    float *buf = dec->sync_buf;
+    size_t len = MIN(npv - 1, SYNC_FFT_SIZE);
 
-    // Get the sync line
-    if (npv < SYNC_PATTERN_SIZE + 2) {
-        res = getpixelv(&(pixelv[npv]), SYNC_PATTERN_SIZE + 2 - npv, getsamples, context);
-        npv += res;
-        if (npv < SYNC_PATTERN_SIZE + 2) return 0;
+    for (size_t i = 0; i < SYNC_FFT_SIZE; i++) {
+        buf[2 * i] = (i < len) ? pixelv[i + 1] : 0.0f;
+        buf[2 * i + 1] = 0.0f;
+    }
+    fft_forward(dec->sync_plan, buf);
+    fft_mul_conj(buf, dec->sync_filter, SYNC_FFT_SIZE);
+    fft_inverse(dec->sync_plan, buf);
+
+    // Sync A correlation is in the real part and sync B in the imaginary part
+    int best = 0;
+    float max = -INFINITY;
+    for (int shift = 0; shift < APT_IMG_WIDTH; shift++) {
+        float score = buf[2 * shift];
+        if (dec->sync_b) score += buf[2 * ((shift + SYNC_B_OFFSET) % APT_IMG_WIDTH) + 1];
+
+        if (score > max) {
+            max = score;
+            best = shift;
+        }
     }
 
-    // Calculate the frequency offset
-    ecorr = convolve(pixelv, sync_pattern, SYNC_PATTERN_SIZE);
-    corr = convolve(&pixelv[1], sync_pattern, SYNC_PATTERN_SIZE - 1);
-    lcorr = convolve(&pixelv[2], sync_pattern, SYNC_PATTERN_SIZE - 2);
-    FreqLine = 1.0 + ((ecorr - lcorr) / corr / APT_IMG_WIDTH / 4.0);
+    *corr = buf[2 * best];
+    return best;
+}
 
-    float val = fabs(lcorr - ecorr) * 0.25 + previous * 0.75;
-    if (val < minDoppler && nrow > 10) {
-        minDoppler = val;
-        *zenith = nrow;
+// Sub-pixel position of a correlation peak relative to the center sample, assuming a triangular peak
+static float sync_interpolate(float early, float peak, float late) {
+    float denominator = peak - MIN(early, late);
+    if (denominator <= 0.0f) return 0.0f;
+
+    return MAX(MIN(0.5f * (late - early) / denominator, 0.5f), -0.5f);
+}
+
+/* Get an entire row of pixels, aligned with sync markers.
+ *
+ * Sync is tracked with a second order loop: the position of the sync marker is
+ * predicted from the previous row and only a few pixels around it are checked.
+ * The timing error (including the sub-pixel part) steers the resampler rate
+ * through FreqLine and is integrated into line_rate, which follows doppler and
+ * sample clock drift. Rows where the marker is not found coast on line_rate,
+ * and only after several misses does the decoder go back to searching the whole
+ * row.
+ */
+int apt_decoder_getpixelrow(apt_decoder_t *dec, float *pixelv, int nrow, int *zenith, int reset, apt_getsamples_t getsamples,
+                            void *context) {
+    if (reset) {
+        dec->synced = 0;
+        dec->locked = 0;
+        dec->line_rate = 0.0f;
+    }
+    dec->sync_offset = 0;
+
+    // Timing error of this row in pixels, only valid if the sync marker was found
+    float error = 0.0f;
+    int found = 0;
+    int res;
+
+    // Move the row buffer into the the image buffer
+    if (dec->npv > 0) memmove(pixelv, dec->pixels, dec->npv * sizeof(float));
+
+    // Get the sync line, plus the search window
+    if (dec->npv < SYNC_PATTERN_SIZE + SYNC_TRACK_WINDOW + 2) {
+        res = getpixelv(dec, &(pixelv[dec->npv]), SYNC_PATTERN_SIZE + SYNC_TRACK_WINDOW + 2 - dec->npv, getsamples, context);
+        dec->npv += res;
+        if (dec->npv < SYNC_PATTERN_SIZE + SYNC_TRACK_WINDOW + 2) return 0;
     }
-    previous = fabs(lcorr - ecorr);
 
-    // The point in which the pixel offset is recalculated
-    if (corr < 0.75 * max) {
-        synced = 0;
-        FreqLine = 1.0;
+    if (dec->locked) {
+        // Check a small window either side of the predicted position (pixelv[1])
+        float window[SYNC_PATTERN_SIZE + 2 * SYNC_TRACK_WINDOW + 2];
+        memcpy(window, dec->sync_tail, SYNC_TRACK_WINDOW * sizeof(float));
+        memcpy(&window[SYNC_TRACK_WINDOW], pixelv, (SYNC_PATTERN_SIZE + SYNC_TRACK_WINDOW + 2) * sizeof(float));
+
+        float corr[2 * SYNC_TRACK_WINDOW + 3];
+        int best = 1;
+        for (int i = 0; i < 2 * SYNC_TRACK_WINDOW + 3; i++) {
+            corr[i] = dec->kernels->convolve(&window[i], sync_pattern, SYNC_PATTERN_SIZE);
+            if (i > 0 && i < 2 * SYNC_TRACK_WINDOW + 2 && corr[i] > corr[best]) best = i;
+        }
+
+        // Integer offsets are left to the loop, so the image isn't torn by single noisy rows
+        if (corr[best] >= SYNC_TRACK_THRESHOLD * dec->sync_level) {
+            error = (best - SYNC_TRACK_WINDOW - 1) + sync_interpolate(corr[best - 1], corr[best], corr[best + 1]);
+            found = 1;
+
+            dec->sync_misses = 0;
+            dec->sync_level += (corr[best] - dec->sync_level) * 0.1f;
+        } else if (++dec->sync_misses >= SYNC_TRACK_MISSES) {
+            // Lost it, search the entire row
+            dec->locked = 0;
+            dec->synced = 0;
+        }
     }
-    max = corr;
 
-    if (synced < 8) {
+    if (!dec->locked) {
         int mshift;
-        static int lastmshift;
 
-        if (npv < APT_IMG_WIDTH + SYNC_PATTERN_SIZE) {
-            res = getpixelv(&(pixelv[npv]), APT_IMG_WIDTH + SYNC_PATTERN_SIZE - npv, getsamples, context);
-            npv += res;
-            if (npv < APT_IMG_WIDTH + SYNC_PATTERN_SIZE) return 0;
+        if (dec->npv < APT_IMG_WIDTH + SYNC_PATTERN_SIZE) {
+            res = getpixelv(dec, &(pixelv[dec->npv]), APT_IMG_WIDTH + SYNC_PATTERN_SIZE - dec->npv, getsamples, context);
+            dec->npv += res;
+            if (dec->npv < APT_IMG_WIDTH + SYNC_PATTERN_SIZE) return 0;
         }
 
-        // Test every possible position until we get the best result
-        mshift = 0;
-        for (int shift = 0; shift < APT_IMG_WIDTH; shift++) {
-            float corr;
-
-            corr = convolve(&(pixelv[shift + 1]), sync_pattern, SYNC_PATTERN_SIZE);
-            if (corr > max) {
-                mshift = shift;
-                max = corr;
-            }
+        // Find the best position over the whole row, only move if it beats the current one
+        float best;
+        dec->max = dec->kernels->convolve(&pixelv[1], sync_pattern, SYNC_PATTERN_SIZE);
+        mshift = sync_search(dec, pixelv, dec->npv, &best);
+        if (best > dec->max) {
+            dec->max = best;
+        } else {
+            mshift = 0;
         }
 
         // Stop rows dissapearing into the void
         int mshiftOrig = mshift;
-        if (abs(lastmshift - mshift) > 3 && nrow != 0) {
+        if (abs(dec->lastmshift - mshift) > 3 && nrow != 0) {
             mshift = 0;
         }
-        lastmshift = mshiftOrig;
+        dec->lastmshift = mshiftOrig;
 
-        // If we are already as aligned as we can get, just continue
+        // If we are already as aligned as we can get, measure the remaining error and lock after a few rows
         if (mshift == 0) {
-            synced++;
+            float early = dec->kernels->convolve(pixelv, sync_pattern, SYNC_PATTERN_SIZE);
+            float late = dec->kernels->convolve(&pixelv[2], sync_pattern, SYNC_PATTERN_SIZE);
+            error = sync_interpolate(early, dec->max, late);
+            found = 1;
+
+            if (++dec->synced >= SYNC_LOCK_ROWS) {
+                dec->locked = 1;
+                dec->sync_misses = 0;
+                dec->sync_level = dec->max;
+            }
         } else {
-            memmove(pixelv, &(pixelv[mshift]), (npv - mshift) * sizeof(float));
-            npv -= mshift;
-            synced = 0;
-            FreqLine = 1.0;
+            memmove(pixelv, &(pixelv[mshift]), (dec->npv - mshift) * sizeof(float));
+            dec->npv -= mshift;
+            dec->synced = 0;
+            dec->sync_offset = mshift;
         }
     }
 
+    // Update the loop and set the resampler rate for the rest of this row, rows without sync coast on line_rate
+    float correction = dec->line_rate;
+    if (found) {
+        dec->line_rate += SYNC_TRACK_BETA * error;
+        correction += SYNC_TRACK_ALPHA * error;
+    }
+    dec->FreqLine = 1.0f - correction / APT_IMG_WIDTH;
+
+    // Closest approach is where the doppler shift (and so the drift of the sync marker) is smallest
+    float val = fabsf(dec->line_rate) * 0.25f + dec->previous * 0.75f;
+    if (val < dec->minDoppler && nrow > 10) {
+        dec->minDoppler = val;
+        *zenith = nrow;
+    }
+    dec->previous = fabsf(dec->line_rate);
+
     // Get the rest of this row
-    if (npv < APT_IMG_WIDTH) {
-        res = getpixelv(&(pixelv[npv]), APT_IMG_WIDTH - npv, getsamples, context);
-        npv += res;
-        if (npv < APT_IMG_WIDTH) return 0;
+    if (dec->npv < APT_IMG_WIDTH) {
+        res = getpixelv(dec, &(pixelv[dec->npv]), APT_IMG_WIDTH - dec->npv, getsamples, context);
+        dec->npv += res;
+        if (dec->npv < APT_IMG_WIDTH) return 0;
     }
+    dec->sync_confidence = sync_confidence(dec, pixelv);
+
+    // Time of the first pixel, counting back from the next one to be resampled
+    float step = RSMULT / ((float)Fi / dec->sample_rate * dec->FreqLine);
+    dec->row_time = (dec->amp_position + dec->offset - dec->npv * step) / dec->sample_rate;
+    memcpy(dec->sync_tail, &pixelv[APT_IMG_WIDTH - SYNC_TRACK_WINDOW], SYNC_TRACK_WINDOW * sizeof(float));
 
     // Move the sync lines into the output buffer with the calculated offset
-    if (npv == APT_IMG_WIDTH) {
-        npv = 0;
+    if (dec->npv == APT_IMG_WIDTH) {
+        dec->npv = 0;
     } else {
-        memmove(pixels, &(pixelv[APT_IMG_WIDTH]), (npv - APT_IMG_WIDTH) * sizeof(float));
-        npv -= APT_IMG_WIDTH;
+        memmove(dec->pixels, &(pixelv[APT_IMG_WIDTH]), (dec->npv - APT_IMG_WIDTH) * sizeof(float));
+        dec->npv -= APT_IMG_WIDTH;
     }
 
     return 1;
 }
+
+int apt_decoder_set_row_callback(apt_decoder_t *dec, apt_row_callback_t callback, void *context) {
+    if (dec->push_row == NULL) {
+        dec->push_row = (float *)malloc(sizeof(float) * APT_PROW_WIDTH);
+        if (dec->push_row == NULL) return 0;
+    }
+
+    dec->row_callback = callback;
+    dec->row_context = context;
+    return 1;
+}
+
+// Read from the samples given to apt_decoder_push_samples, never waits for more
+static int push_getsamples(void *context, float *samples, int count) {
+    apt_decoder_t *dec = (apt_decoder_t *)context;
+    size_t n = MIN((size_t)count, dec->push_count);
+
+    memcpy(samples, dec->push_samples, n * sizeof(float));
+    dec->push_samples += n;
+    dec->push_count -= n;
+    return (int)n;
+}
+
+/* Whether there is enough amplitude buffered to finish a row without waiting
+ * for more input. While searching for sync a row can take up to two rows
+ * worth of pixels (the search window, plus the rest of the row after
+ * skipping up to a whole row), 2% is left for the resampler rate changing
+ * during the row. That's budgeted even when locked, as lock can be lost
+ * partway through a row, and apt_decoder_getpixelrow can't pick up a row
+ * it ran out of input for.
+ */
+static int push_row_ready(const apt_decoder_t *dec) {
+    size_t pixels = 2 * APT_IMG_WIDTH + SYNC_PATTERN_SIZE - dec->npv;
+    float step = RSMULT / ((float)Fi / dec->sample_rate * dec->FreqLine);
+    size_t needed = (size_t)(pixels * step * 1.02f) + dec->ntaps + 2;
+
+    return mirror_count(&dec->ampbuff) >= MIN(needed, dec->ampbuff.size);
+}
+
+/* Demodulate the samples and pass every row finished along the way to the
+ * row callback. Samples go straight into the first stage of the decoder, and
+ * only the last few thousand (not enough for an FFT block or a row) are held
+ * back until the next call.
+ */
+void apt_decoder_push_samples(apt_decoder_t *dec, const float *samples, size_t count) {
+    dec->push_samples = samples;
+    dec->push_count = count;
+
+    for (;;) {
+        // Demodulate everything that fits
+        size_t space;
+        while ((space = mirror_space(&dec->ampbuff)) > 0) {
+            int res = getamp(dec, mirror_tail(&dec->ampbuff), (int)space, push_getsamples, dec);
+            mirror_commit(&dec->ampbuff, res);
+            if ((size_t)res < space) break;
+        }
+
+        if (!push_row_ready(dec)) break;
+        if (!apt_decoder_getpixelrow(dec, dec->push_row, dec->push_nrow, &dec->push_zenith, dec->push_nrow == 0,
+                                     push_getsamples, dec)) {
+            break;
+        }
+        if (dec->row_callback != NULL) {
+            dec->row_callback(dec->row_context, dec->push_row, dec->push_nrow, dec->push_zenith);
+        }
+        dec->push_nrow++;
+    }
+
+    dec->push_samples = NULL;
+    dec->push_count = 0;
+}
+
+/* Decode up to max_rows rows one after another, row i going to dst + i * stride.
+ * The resampler writes the start of the next row while finishing the current
+ * one, so rows closer together than APT_PROW_WIDTH only work because each row
+ * is written before the next one. The last row is finished in a scratch
+ * buffer instead, so nothing past the end of dst is written.
+ */
+int apt_decoder_getpixelrows(apt_decoder_t *dec, float *dst, size_t stride, int max_rows, int nrow, int *zenith,
+                             apt_row_info_t *info, apt_getsamples_t getsamples, void *context) {
+    if (stride < APT_IMG_WIDTH) return 0;
+
+    int n;
+    for (n = 0; n < max_rows; n++) {
+        float scratch[APT_PROW_WIDTH];
+        float *row = &dst[n * stride];
+        int last = (n == max_rows - 1 && stride < APT_PROW_WIDTH);
+
+        if (!apt_decoder_getpixelrow(dec, last ? scratch : row, nrow + n, zenith, nrow + n == 0, getsamples, context)) break;
+        if (last) memcpy(row, scratch, APT_IMG_WIDTH * sizeof(float));
+        if (info != NULL) apt_decoder_get_row_info(dec, &info[n]);
+    }
+
+    return n;
+}
+
+// Decoder used by the single stream API below
+static apt_decoder_t *default_decoder = NULL;
+
+// Initalise and configure PLL
+int apt_init(double sample_rate) {
+    if (sample_rate > Fi * (1 << MAX_DECIMATION_STAGES)) return 1;
+    if (sample_rate < APT_IMG_WIDTH * 2) return -1;
+
+    apt_decoder_free(default_decoder);
+    default_decoder = apt_decoder_create(sample_rate);
+    if (default_decoder == NULL) return -1;
+
+    return 0;
+}
+
+int apt_getpixelrow(float *pixelv, int nrow, int *zenith, int reset, apt_getsamples_t getsamples, void *context) {
+    return apt_decoder_getpixelrow(default_decoder, pixelv, nrow, zenith, reset, getsamples, context);
+}
@@ -0,0 +1,145 @@
+/*
+ * aptdec - A lightweight FOSS (NOAA) APT decoder
+ * Copyright (C) 2019-2022 Xerbo (xerbo@protonmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fft.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+fft_plan_t *fft_plan_create(size_t n) {
+    if (n < 2 || (n & (n - 1)) != 0) return NULL;
+
+    fft_plan_t *plan = (fft_plan_t *)malloc(sizeof(fft_plan_t));
+    if (plan == NULL) return NULL;
+    plan->n = n;
+    plan->twiddle = (float *)malloc(sizeof(float) * 2 * n);
+    plan->bitrev = (size_t *)malloc(sizeof(size_t) * n);
+    if (plan->twiddle == NULL || plan->bitrev == NULL) {
+        fft_plan_free(plan);
+        return NULL;
+    }
+
+    // Twiddle factors of each stage stored one after another, e^(-2*pi*i*k/len) for len = 2, 4, ..., n
+    for (size_t len = 2, base = 0; len <= n; base += len / 2, len *= 2) {
+        for (size_t k = 0; k < len / 2; k++) {
+            double angle = -2.0 * 3.14159265358979323846 * k / len;
+            plan->twiddle[2 * (base + k) + 0] = (float)cos(angle);
+            plan->twiddle[2 * (base + k) + 1] = (float)sin(angle);
+        }
+    }
+
+    size_t bits = 0;
+    while (((size_t)1 << bits) < n) bits++;
+    for (size_t i = 0; i < n; i++) {
+        size_t r = 0;
+        for (size_t b = 0; b < bits; b++) {
+            if (i & ((size_t)1 << b)) r |= (size_t)1 << (bits - 1 - b);
+        }
+        plan->bitrev[i] = r;
+    }
+
+    return plan;
+}
+
+void fft_plan_free(fft_plan_t *plan) {
+    if (plan == NULL) return;
+    free(plan->twiddle);
+    free(plan->bitrev);
+    free(plan);
+}
+
+// Iterative decimation in time FFT, sign selects the direction of the twiddle factors
+static void fft(const fft_plan_t *plan, float *buf, float sign) {
+    const size_t n = plan->n;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t j = plan->bitrev[i];
+        if (j > i) {
+            float re = buf[2 * i], im = buf[2 * i + 1];
+            buf[2 * i] = buf[2 * j];
+            buf[2 * i + 1] = buf[2 * j + 1];
+            buf[2 * j] = re;
+            buf[2 * j + 1] = im;
+        }
+    }
+
+    // The first two stages only need twiddle factors of 1 and -i, done together as radix-4 butterflies
+    if (n >= 4) {
+        for (size_t start = 0; start < n; start += 4) {
+            float *x = &buf[2 * start];
+            float ar = x[0] + x[2], ai = x[1] + x[3];
+            float br = x[0] - x[2], bi = x[1] - x[3];
+            float cr = x[4] + x[6], ci = x[5] + x[7];
+            float dr = x[4] - x[6], di = x[5] - x[7];
+
+            // d * -i (or i for the inverse)
+            float er = di * sign, ei = -dr * sign;
+
+            x[0] = ar + cr;
+            x[1] = ai + ci;
+            x[4] = ar - cr;
+            x[5] = ai - ci;
+            x[2] = br + er;
+            x[3] = bi + ei;
+            x[6] = br - er;
+            x[7] = bi - ei;
+        }
+    }
+
+    // Twiddle factors of the remaining stages start after the first two (1 + 2 entries)
+    size_t len = (n >= 4) ? 8 : 2;
+    const float *twiddle = &plan->twiddle[(n >= 4) ? 6 : 0];
+    for (; len <= n; len *= 2) {
+        size_t half = len / 2;
+
+        for (size_t start = 0; start < n; start += len) {
+            float *a = &buf[2 * start];
+            float *b = &buf[2 * (start + half)];
+            for (size_t k = 0; k < half; k++) {
+                float wr = twiddle[2 * k];
+                float wi = twiddle[2 * k + 1] * sign;
+                float tr = b[2 * k] * wr - b[2 * k + 1] * wi;
+                float ti = b[2 * k] * wi + b[2 * k + 1] * wr;
+
+                b[2 * k] = a[2 * k] - tr;
+                b[2 * k + 1] = a[2 * k + 1] - ti;
+                a[2 * k] += tr;
+                a[2 * k + 1] += ti;
+            }
+        }
+        twiddle += 2 * half;
+    }
+}
+
+void fft_forward(const fft_plan_t *plan, float *buf) { fft(plan, buf, 1.0f); }
+
+void fft_inverse(const fft_plan_t *plan, float *buf) {
+    fft(plan, buf, -1.0f);
+
+    float scale = 1.0f / plan->n;
+    for (size_t i = 0; i < 2 * plan->n; i++) buf[i] *= scale;
+}
+
+void fft_mul_conj(float *a, const float *b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        float re = a[2 * i] * b[2 * i] + a[2 * i + 1] * b[2 * i + 1];
+        float im = a[2 * i + 1] * b[2 * i] - a[2 * i] * b[2 * i + 1];
+        a[2 * i] = re;
+        a[2 * i + 1] = im;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * aptdec - A lightweight FOSS (NOAA) APT decoder
+ * Copyright (C) 2019-2022 Xerbo (xerbo@protonmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef APTDEC_FFT_H
+#define APTDEC_FFT_H
+#include <stddef.h>
+
+// Precomputed tables for a radix-2 complex FFT of a fixed size
+typedef struct {
+    size_t n;
+    float *twiddle;  // Complex twiddle factors of each stage, n - 1 in total
+    size_t *bitrev;  // Bit reversal permutation
+} fft_plan_t;
+
+// n must be a power of 2, returns NULL on failure
+fft_plan_t *fft_plan_create(size_t n);
+void fft_plan_free(fft_plan_t *plan);
+
+// In place transforms of n complex values, stored as interleaved real and imaginary parts.
+// The inverse is scaled by 1/n, so fft_inverse(fft_forward(x)) == x
+void fft_forward(const fft_plan_t *plan, float *buf);
+void fft_inverse(const fft_plan_t *plan, float *buf);
+
+// Multiply each element of a by the conjugate of the matching element of b, storing the result in a
+void fft_mul_conj(float *a, const float *b, size_t n);
+
+#endif
@@ -48,15 +48,4 @@ complexf_t hilbert_transform(const float *in, const float *taps, size_t len) {
 #endif
 }
 
-float interpolating_convolve(const float *in, const float *taps, size_t len, float offset, float delta) {
-    float out = 0.0;
-    float n = offset;
-
-    for (size_t i = 0; i < (len - 1) / delta - 1; n += delta, i++) {
-        int k = (int)floor(n);
-        float alpha = n - k;
-
-        out += in[i] * (taps[k] * (1.0f - alpha) + taps[k + 1] * alpha);
-    }
-    return out;
-}
+const filter_kernels_t filter_kernels_scalar = {"scalar", convolve};
@@ -27,4 +27,14 @@ typedef complex float complexf_t;
 
 float convolve(const float *in, const float *taps, size_t len);
 complexf_t hilbert_transform(const float *in, const float *taps, size_t len);
-float interpolating_convolve(const float *in, const float *taps, size_t len, float offset, float delta);
+
+// A set of filter kernels for one instruction set
+typedef struct {
+    const char *name;
+    float (*convolve)(const float *in, const float *taps, size_t len);
+} filter_kernels_t;
+
+extern const filter_kernels_t filter_kernels_scalar;
+
+// Get the fastest kernels supported by the CPU we are running on
+const filter_kernels_t *filter_get_kernels(void);
@@ -0,0 +1,130 @@
+/*
+ * aptdec - A lightweight FOSS (NOAA) APT decoder
+ * Copyright (C) 2019-2022 Xerbo (xerbo@protonmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Vectorized versions of the kernels in filter.c, each one is compiled for
+// its own instruction set and picked at runtime by filter_get_kernels
+
+#include "filter.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILTER_X86
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#elif defined(__ARM_NEON)
+#define FILTER_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef FILTER_X86
+TARGET("sse4.1") static float hsum_sse(__m128 v) {
+    __m128 shuf = _mm_movehl_ps(v, v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_shuffle_ps(sums, sums, 1);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+TARGET("avx2") static float hsum_avx(__m256 v) {
+    return hsum_sse(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+// SSE4.1
+TARGET("sse4.1") static float convolve_sse41(const float *in, const float *taps, size_t len) {
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(&in[i]), _mm_loadu_ps(&taps[i])));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(&in[i + 4]), _mm_loadu_ps(&taps[i + 4])));
+    }
+    float sum = hsum_sse(_mm_add_ps(acc0, acc1));
+    for (; i < len; i++) sum += in[i] * taps[i];
+
+    return sum;
+}
+
+static const filter_kernels_t filter_kernels_sse41 = {"sse4.1", convolve_sse41};
+
+// AVX2 + FMA
+TARGET("avx2,fma") static float convolve_avx2(const float *in, const float *taps, size_t len) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(&in[i]), _mm256_loadu_ps(&taps[i]), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(&in[i + 8]), _mm256_loadu_ps(&taps[i + 8]), acc1);
+    }
+    for (; i + 8 <= len; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(&in[i]), _mm256_loadu_ps(&taps[i]), acc0);
+    }
+    float sum = hsum_avx(_mm256_add_ps(acc0, acc1));
+    for (; i < len; i++) sum += in[i] * taps[i];
+
+    return sum;
+}
+
+static const filter_kernels_t filter_kernels_avx2 = {"avx2", convolve_avx2};
+
+// AVX-512
+TARGET("avx512f") static float convolve_avx512(const float *in, const float *taps, size_t len) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(&in[i]), _mm512_loadu_ps(&taps[i]), acc);
+    }
+    if (i < len) {
+        __mmask16 mask = (__mmask16)((1u << (len - i)) - 1);
+        acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, &in[i]), _mm512_maskz_loadu_ps(mask, &taps[i]), acc);
+    }
+
+    return _mm512_reduce_add_ps(acc);
+}
+
+static const filter_kernels_t filter_kernels_avx512 = {"avx512", convolve_avx512};
+#endif
+
+#ifdef FILTER_NEON
+static float convolve_neon(const float *in, const float *taps, size_t len) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(&in[i]), vld1q_f32(&taps[i]));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(&in[i + 4]), vld1q_f32(&taps[i + 4]));
+    }
+    acc0 = vaddq_f32(acc0, acc1);
+    float sum = vgetq_lane_f32(acc0, 0) + vgetq_lane_f32(acc0, 1) + vgetq_lane_f32(acc0, 2) + vgetq_lane_f32(acc0, 3);
+    for (; i < len; i++) sum += in[i] * taps[i];
+
+    return sum;
+}
+
+static const filter_kernels_t filter_kernels_neon = {"neon", convolve_neon};
+#endif
+
+const filter_kernels_t *filter_get_kernels(void) {
+#if defined(FILTER_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return &filter_kernels_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return &filter_kernels_avx2;
+    if (__builtin_cpu_supports("sse4.1")) return &filter_kernels_sse41;
+#elif defined(FILTER_NEON)
+    return &filter_kernels_neon;
+#endif
+    return &filter_kernels_scalar;
+}
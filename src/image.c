@@ -20,71 +20,206 @@
 #include "image.h"
 
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#ifdef APT_HAVE_THREADS
+#include <threads.h>
+#endif
 
 #include "algebra.h"
 #include "apt.h"
 #include "util.h"
 
-static linear_t compute_regression(float *wedges) {
-    //				    { 0.106, 0.215, 0.324, 0.433, 0.542,  0.652, 0.78,   0.87,  0.0 }
-    const float teleramp[9] = {31.07, 63.02, 94.96, 126.9, 158.86, 191.1, 228.62, 255.0, 0.0};
+#ifdef _WIN32
+#define aligned_alloc(alignment, size) _aligned_malloc(size, alignment)
+#define aligned_free _aligned_free
+#else
+#define aligned_free free
+#endif
+
+// Bytes between rows of a chunk, a whole number of 64 byte cache lines
+static size_t row_bytes(apt_format_t format) {
+    size_t size = (format == APT_FORMAT_U8) ? 1 : (format == APT_FORMAT_U16) ? 2 : sizeof(float);
+    return (APT_PROW_WIDTH * size + 63) / 64 * 64;
+}
 
-    return linear_regression(wedges, teleramp, 9);
+static void *row_ptr(const apt_image_t *img, int y) {
+    return (char *)img->chunks[y / APT_IMAGE_CHUNK] + (y % APT_IMAGE_CHUNK) * row_bytes(img->format);
 }
 
-static float tele[16];
-static float Cs;
+int apt_image_alloc(apt_image_t *img, int rows) {
+    img->prow = NULL;
+    img->chunks = NULL;
+    img->capacity = 0;
+    img->format = APT_FORMAT_FLOAT;
+    img->flipped = 0;
 
-void apt_histogramEqualise(float **prow, int nrow, int offset, int width) {
-    // Plot histogram
-    int histogram[256] = {0};
-    for (int y = 0; y < nrow; y++)
-        for (int x = 0; x < width; x++) histogram[(int)CLIP(prow[y][x + offset], 0, 255)]++;
+    return apt_image_reserve(img, MAX(rows, 1));
+}
+
+// Chunks the pointer arrays have room for, the next power of 2, so a growing image only moves them a few times
+static int chunk_slots(int nchunks) {
+    int slots = 1;
+    while (slots < nchunks) slots *= 2;
+    return (nchunks == 0) ? 0 : slots;
+}
 
-    // Calculate cumulative frequency
-    long sum = 0, cf[256] = {0};
-    for (int i = 0; i < 255; i++) {
-        sum += histogram[i];
-        cf[i] = sum;
+int apt_image_reserve(apt_image_t *img, int rows) {
+    if (rows <= img->capacity) return 1;
+
+    // Only the pointer arrays grow ahead, chunks are allocated for the rows asked for
+    int nchunks = img->capacity / APT_IMAGE_CHUNK;
+    int needed = (rows + APT_IMAGE_CHUNK - 1) / APT_IMAGE_CHUNK;
+    int slots = chunk_slots(needed);
+    if (slots > chunk_slots(nchunks)) {
+        void **chunks = (void **)realloc(img->chunks, sizeof(void *) * slots);
+        if (chunks == NULL) return 0;
+        img->chunks = chunks;
+        float **prow = (float **)realloc(img->prow, sizeof(float *) * slots * APT_IMAGE_CHUNK);
+        if (prow == NULL) return 0;
+        img->prow = prow;
     }
 
-    // Apply histogram
-    int area = nrow * width;
-    for (int y = 0; y < nrow; y++) {
-        for (int x = 0; x < width; x++) {
-            int k = (int)prow[y][x + offset];
-            prow[y][x + offset] = (256.0f / area) * cf[k];
+    for (; nchunks < needed; nchunks++) {
+        void *chunk = aligned_alloc(64, row_bytes(img->format) * APT_IMAGE_CHUNK);
+        if (chunk == NULL) return 0;
+
+        img->chunks[nchunks] = chunk;
+        img->capacity += APT_IMAGE_CHUNK;
+        for (int y = nchunks * APT_IMAGE_CHUNK; y < img->capacity; y++) {
+            img->prow[y] = (img->format == APT_FORMAT_FLOAT) ? (float *)row_ptr(img, y) : NULL;
         }
     }
+
+    return 1;
 }
 
-void apt_linearEnhance(float **prow, int nrow, int offset, int width) {
-    // Plot histogram
-    int histogram[256] = {0};
-    for (int y = 0; y < nrow; y++)
-        for (int x = 0; x < width; x++) histogram[(int)CLIP(prow[y][x + offset], 0, 255)]++;
-
-    // Find min/max points
-    int min = -1, max = -1;
-    for (int i = 5; i < 250; i++) {
-        if (histogram[i] / width / (nrow / 255.0) > 0.1) {
-            if (min == -1) min = i;
-            max = i;
-        }
+void apt_image_free(apt_image_t *img) {
+    for (int i = 0; i < img->capacity / APT_IMAGE_CHUNK; i++) aligned_free(img->chunks[i]);
+    free(img->chunks);
+    free(img->prow);
+    img->prow = NULL;
+    img->chunks = NULL;
+    img->capacity = 0;
+    img->nrow = 0;
+}
+
+int apt_image_copy(apt_image_t *dst, const apt_image_t *src) {
+    dst->prow = NULL;
+    dst->chunks = NULL;
+    dst->capacity = 0;
+    dst->format = src->format;
+    dst->flipped = src->flipped;
+    if (!apt_image_reserve(dst, MAX(src->nrow, 1))) {
+        apt_image_free(dst);
+        return 0;
     }
 
-    // Stretch the brightness into the new range
-    for (int y = 0; y < nrow; y++) {
-        for (int x = 0; x < width; x++) {
-            prow[y][x + offset] = (prow[y][x + offset] - min) / (max - min) * 255.0f;
-            prow[y][x + offset] = CLIP(prow[y][x + offset], 0.0f, 255.0f);
+    for (int y = 0; y < src->nrow; y += APT_IMAGE_CHUNK) {
+        int rows = MIN(src->nrow - y, APT_IMAGE_CHUNK);
+        memcpy(dst->chunks[y / APT_IMAGE_CHUNK], src->chunks[y / APT_IMAGE_CHUNK], row_bytes(src->format) * rows);
+    }
+    dst->nrow = src->nrow;
+    return 1;
+}
+
+/* Convert a float image into a compact format. Each chunk is converted in
+ * place (a compact row never reaches past the float row it comes from) and
+ * then moved into a smaller block, so the image never takes much more memory
+ * than the float image itself, and can't be left half converted. Values are
+ * clipped to 0-255 and rounded down, like every use of a pixel as an integer
+ * (histograms, palettes and 8 bit output), so (int)pixel is the same in any
+ * format.
+ */
+int apt_image_compact(apt_image_t *img, apt_format_t format) {
+    if (img->format != APT_FORMAT_FLOAT || format == APT_FORMAT_FLOAT) return img->format == format;
+
+    size_t bytes = row_bytes(format);
+    for (int i = 0; i < img->capacity / APT_IMAGE_CHUNK; i++) {
+        char *chunk = (char *)img->chunks[i];
+
+        for (int y = 0; y < APT_IMAGE_CHUNK && i * APT_IMAGE_CHUNK + y < img->nrow; y++) {
+            // Through a buffer, as the first rows overlap
+            const float *row = img->prow[i * APT_IMAGE_CHUNK + y];
+            if (format == APT_FORMAT_U16) {
+                uint16_t dst[APT_PROW_WIDTH];
+                for (int x = 0; x < APT_PROW_WIDTH; x++) dst[x] = (uint16_t)(CLIP(row[x], 0.0f, 255.0f) * 256.0f);
+                memcpy(&chunk[y * bytes], dst, sizeof(dst));
+            } else {
+                uint8_t dst[APT_PROW_WIDTH];
+                for (int x = 0; x < APT_PROW_WIDTH; x++) dst[x] = (uint8_t)CLIP(row[x], 0.0f, 255.0f);
+                memcpy(&chunk[y * bytes], dst, sizeof(dst));
+            }
+        }
+
+        // Keep the full size block if a smaller one can't be had, it works just the same
+        void *smaller = aligned_alloc(64, bytes * APT_IMAGE_CHUNK);
+        if (smaller != NULL) {
+            memcpy(smaller, chunk, bytes * APT_IMAGE_CHUNK);
+            aligned_free(chunk);
+            img->chunks[i] = smaller;
         }
     }
+
+    img->format = format;
+    for (int y = 0; y < img->capacity; y++) img->prow[y] = NULL;
+    return 1;
 }
 
+// Stored row y as floats, without the flip of apt_image_load_row
+static float *load_row(const apt_image_t *img, int y, float *buf) {
+    if (img->format == APT_FORMAT_FLOAT) return img->prow[y];
+
+    if (img->format == APT_FORMAT_U16) {
+        const uint16_t *row = (const uint16_t *)row_ptr(img, y);
+        for (int x = 0; x < APT_PROW_WIDTH; x++) buf[x] = row[x] * (1.0f / 256.0f);
+    } else {
+        const uint8_t *row = (const uint8_t *)row_ptr(img, y);
+        for (int x = 0; x < APT_PROW_WIDTH; x++) buf[x] = row[x];
+    }
+    return buf;
+}
+
+// Pixels begin to end of stored row y as floats, into the same place in buf
+static void load_span(const apt_image_t *img, int y, float *buf, int begin, int end) {
+    if (img->format == APT_FORMAT_FLOAT) {
+        memcpy(&buf[begin], &img->prow[y][begin], sizeof(float) * (end - begin));
+    } else if (img->format == APT_FORMAT_U16) {
+        const uint16_t *row = (const uint16_t *)row_ptr(img, y);
+        for (int x = begin; x < end; x++) buf[x] = row[x] * (1.0f / 256.0f);
+    } else {
+        const uint8_t *row = (const uint8_t *)row_ptr(img, y);
+        for (int x = begin; x < end; x++) buf[x] = row[x];
+    }
+}
+
+static void store_row(apt_image_t *img, int y, const float *row, int offset, int width) {
+    if (img->format == APT_FORMAT_FLOAT) {
+        if (row != img->prow[y]) memcpy(&img->prow[y][offset], &row[offset], sizeof(float) * width);
+    } else if (img->format == APT_FORMAT_U16) {
+        uint16_t *dst = (uint16_t *)row_ptr(img, y);
+        for (int x = offset; x < offset + width; x++) dst[x] = (uint16_t)(CLIP(row[x], 0.0f, 255.0f) * 256.0f);
+    } else {
+        uint8_t *dst = (uint8_t *)row_ptr(img, y);
+        for (int x = offset; x < offset + width; x++) dst[x] = (uint8_t)CLIP(row[x], 0.0f, 255.0f);
+    }
+}
+
+static linear_t compute_regression(float *wedges) {
+    //				    { 0.106, 0.215, 0.324, 0.433, 0.542,  0.652, 0.78,   0.87,  0.0 }
+    const float teleramp[9] = {31.07, 63.02, 94.96, 126.9, 158.86, 191.1, 228.62, 255.0, 0.0};
+
+    return linear_regression(wedges, teleramp, 9);
+}
+
+static float tele[16];
+static float Cs;
+
 // Brightness calibrate, including telemetry
 void calibrateImage(float **prow, int nrow, int offset, int width, linear_t regr) {
     offset -= APT_SYNC_WIDTH + APT_SPC_WIDTH;
@@ -107,9 +242,8 @@ float teleNoise(float *wedges) {
 
 // Get telemetry data for thermal calibration
 apt_channel_t apt_calibrate(float **prow, int nrow, int offset, int width) {
-    float teleline[APT_MAX_HEIGHT] = {0.0};
     float wedge[16];
-    linear_t regr[APT_MAX_HEIGHT / APT_FRAME_LEN + 1];
+    linear_t regr;
     int telestart, mtelestart = 0;
     int channel = -1;
 
@@ -119,6 +253,9 @@ apt_channel_t apt_calibrate(float **prow, int nrow, int offset, int width) {
         return APT_CHANNEL_UNKNOWN;
     }
 
+    float *teleline = (float *)calloc(nrow, sizeof(float));
+    if (teleline == NULL) return APT_CHANNEL_UNKNOWN;
+
     // Calculate average of a row of telemetry
     for (int y = 0; y < nrow; y++) {
         for (int x = 3; x < 43; x++) teleline[y] += prow[y][x + offset + width];
@@ -150,6 +287,7 @@ apt_channel_t apt_calibrate(float **prow, int nrow, int offset, int width) {
     // Make sure that theres at least one full frame in the image
     if (nrow < telestart + APT_FRAME_LEN) {
         error_noexit("Telemetry decoding error, not enough rows");
+        free(teleline);
         return APT_CHANNEL_UNKNOWN;
     }
 
@@ -173,8 +311,8 @@ apt_channel_t apt_calibrate(float **prow, int nrow, int offset, int width) {
             bestFrame = k;
 
             // Compute & apply regression on the wedges
-            regr[k] = compute_regression(wedge);
-            for (int j = 0; j < 16; j++) tele[j] = linear_calc(wedge[j], regr[k]);
+            regr = compute_regression(wedge);
+            for (int j = 0; j < 16; j++) tele[j] = linear_calc(wedge[j], regr);
 
             /* Compare the channel ID wedge to the reference
              * wedges, the wedge with the closest match will
@@ -204,62 +342,522 @@ apt_channel_t apt_calibrate(float **prow, int nrow, int offset, int width) {
                     i++;
                 }
             }
-            Cs = linear_calc((Cs / i), regr[k]);
+            Cs = linear_calc((Cs / i), regr);
         }
     }
 
+    free(teleline);
     if (bestFrame == -1) {
         error_noexit("Something has gone very wrong, please file a bug report");
         return APT_CHANNEL_UNKNOWN;
     }
 
-    calibrateImage(prow, nrow, offset, width, regr[bestFrame]);
+    calibrateImage(prow, nrow, offset, width, regr);
 
     return (apt_channel_t)(channel + 1);
 }
 
-extern float quick_select(float arr[], int n);
+/* Sorting network for 12 inputs (39 comparisons, 9 deep), cut down to the
+ * comparisons that decide s[5], the lower median. Being the same sequence
+ * of min/max for every pixel, it runs on a vector of pixels at a time with
+ * no branches.
+ */
+#define MEDIAN12_NETWORK                                                                                                 \
+    CE(0, 8) CE(1, 7) CE(2, 6) CE(3, 11) CE(4, 10) CE(5, 9) CE(0, 1) CE(2, 5) CE(3, 4) CE(6, 9) CE(7, 8) CE(10, 11)      \
+    CE(0, 2) CE(1, 6) CE(5, 10) CE(9, 11) CE(0, 3) CE(1, 2) CE(4, 6) CE(5, 7) CE(8, 11) CE(9, 10) CE(1, 4) CE(3, 5)     \
+    CE(6, 8) CE(7, 10) CE(2, 5) CE(6, 9) CE(4, 5) CE(6, 7) CE(4, 6) CE(5, 7) CE(5, 6)
+
+static float median12(float s[12]) {
+#define CE(i, j)                                  \
+    {                                             \
+        float lo = (s[i] < s[j]) ? s[i] : s[j];   \
+        s[j] = (s[i] < s[j]) ? s[j] : s[i];       \
+        s[i] = lo;                                \
+    }
+    MEDIAN12_NETWORK
+#undef CE
+    return s[5];
+}
 
-// Biased median denoise, pretyt ugly
-#define TRIG_LEVEL 40
-void apt_denoise(float **prow, int nrow, int offset, int width) {
-    for (int y = 2; y < nrow - 2; y++) {
-        for (int x = offset + 1; x < offset + width - 1; x++) {
-            if (prow[y][x + 1] - prow[y][x] > TRIG_LEVEL || prow[y][x - 1] - prow[y][x] > TRIG_LEVEL ||
-                prow[y + 1][x] - prow[y][x] > TRIG_LEVEL || prow[y - 1][x] - prow[y][x] > TRIG_LEVEL) {
-                prow[y][x] = quick_select((float[]){prow[y + 2][x - 1], prow[y + 2][x], prow[y + 2][x + 1], prow[y + 1][x - 1],
-                                                    prow[y + 1][x], prow[y + 1][x + 1], prow[y - 1][x - 1], prow[y - 1][x],
-                                                    prow[y - 1][x + 1], prow[y - 2][x - 1], prow[y - 2][x], prow[y - 2][x + 1]},
-                                          12);
-            }
+// Pixels of a channel more than this darker than a neighbour are replaced by the median of the pixels around them
+#define TRIG_LEVEL 40.0f
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define IMAGE_VECTOR
+typedef __m128 vec_t;
+#define vec_load _mm_loadu_ps
+#define vec_store _mm_storeu_ps
+#define vec_min _mm_min_ps
+#define vec_max _mm_max_ps
+#define vec_reverse(v) _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 1, 2, 3))
+
+// c where no neighbour n is more than TRIG_LEVEL brighter, m elsewhere
+static inline vec_t vec_trigger(vec_t c, const vec_t n[4], vec_t m) {
+    __m128 level = _mm_set1_ps(TRIG_LEVEL);
+    __m128 mask = _mm_cmpgt_ps(_mm_sub_ps(n[0], c), level);
+    for (int i = 1; i < 4; i++) mask = _mm_or_ps(mask, _mm_cmpgt_ps(_mm_sub_ps(n[i], c), level));
+    return _mm_or_ps(_mm_and_ps(mask, m), _mm_andnot_ps(mask, c));
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define IMAGE_VECTOR
+typedef float32x4_t vec_t;
+#define vec_load vld1q_f32
+#define vec_store vst1q_f32
+#define vec_min vminq_f32
+#define vec_max vmaxq_f32
+
+static inline vec_t vec_reverse(vec_t v) {
+    float32x4_t r = vrev64q_f32(v);
+    return vcombine_f32(vget_high_f32(r), vget_low_f32(r));
+}
+
+static inline vec_t vec_trigger(vec_t c, const vec_t n[4], vec_t m) {
+    float32x4_t level = vdupq_n_f32(TRIG_LEVEL);
+    uint32x4_t mask = vcgtq_f32(vsubq_f32(n[0], c), level);
+    for (int i = 1; i < 4; i++) mask = vorrq_u32(mask, vcgtq_f32(vsubq_f32(n[i], c), level));
+    return vbslq_f32(mask, m, c);
+}
+#endif
+
+/* Biased median denoise of row r[2] of a channel into out, r[0] and r[1]
+ * being the rows above and r[3] and r[4] the ones below. Only the input is
+ * read, so rows can be denoised in any order (or at the same time).
+ */
+static void denoise_row(float *out, float *const r[5], int offset, int width) {
+    int x = offset + 1, end = offset + width - 1;
+    out[offset] = r[2][offset];
+    out[end] = r[2][end];
+
+#ifdef IMAGE_VECTOR
+    for (; x + 4 <= end; x += 4) {
+        vec_t n[4] = {vec_load(&r[2][x - 1]), vec_load(&r[2][x + 1]), vec_load(&r[1][x]), vec_load(&r[3][x])};
+        vec_t s[12];
+        for (int i = 0, k = 0; i < 5; i++) {
+            if (i == 2) continue;
+            for (int dx = -1; dx <= 1; dx++) s[k++] = vec_load(&r[i][x + dx]);
+        }
+#define CE(i, j)                               \
+    {                                          \
+        vec_t lo = vec_min(s[i], s[j]);        \
+        s[j] = vec_max(s[i], s[j]);            \
+        s[i] = lo;                             \
+    }
+        MEDIAN12_NETWORK
+#undef CE
+        vec_store(&out[x], vec_trigger(vec_load(&r[2][x]), n, s[5]));
+    }
+#endif
+
+    for (; x < end; x++) {
+        out[x] = r[2][x];
+        if (r[2][x + 1] - r[2][x] > TRIG_LEVEL || r[2][x - 1] - r[2][x] > TRIG_LEVEL || r[3][x] - r[2][x] > TRIG_LEVEL ||
+            r[1][x] - r[2][x] > TRIG_LEVEL) {
+            out[x] = median12((float[]){r[4][x - 1], r[4][x], r[4][x + 1], r[3][x - 1], r[3][x], r[3][x + 1], r[1][x - 1],
+                                        r[1][x], r[1][x + 1], r[0][x - 1], r[0][x], r[0][x + 1]});
         }
     }
 }
 #undef TRIG_LEVEL
 
-// Flips a channel, for northbound passes
-void apt_flipImage(apt_image_t *img, int width, int offset) {
-    for (int y = 1; y < img->nrow; y++) {
-        for (int x = 1; x < ceil(width / 2.0); x++) {
-            // Flip top-left & bottom-right
-            float buffer = img->prow[img->nrow - y][offset + x];
-            img->prow[img->nrow - y][offset + x] = img->prow[y][offset + (width - x)];
-            img->prow[y][offset + (width - x)] = buffer;
+/* Northbound passes are shown turned half a turn, with both channels
+ * mirrored either way: pixel x of row y swaps with pixel width - x of row
+ * nrow - y. Row 0, the first pixel of each channel and everything outside
+ * the channels stay where they are (as the flip always has). Rather than
+ * moving any pixels, apt_image_flip only marks the image, and rows are
+ * mapped on the way in and out by apt_image_load_row and
+ * apt_image_store_row. The writer and the effect passes already copy each
+ * row they read, so they see the flipped image for nothing more than a
+ * reversed copy.
+ */
+
+// dst[mirror - x] = src[x] for x from begin to end
+static void mirror_span(float *dst, const float *src, int begin, int end, int mirror) {
+    int x = begin;
+#ifdef IMAGE_VECTOR
+    for (; x + 4 <= end; x += 4) vec_store(&dst[mirror - x - 3], vec_reverse(vec_load(&src[x])));
+#endif
+    for (; x < end; x++) dst[mirror - x] = src[x];
+}
+
+// Row stored in place of row y of a flipped image, and the other way around
+static int flip_row(const apt_image_t *img, int y) {
+    return (y == 0) ? 0 : img->nrow - y;
+}
+
+static const int channels[2] = {APT_CHA_OFFSET, APT_CHB_OFFSET};
+
+float *apt_image_load_row(const apt_image_t *img, int y, float *buf) {
+    if (!img->flipped || y == 0) return load_row(img, y, buf);
+
+    /* Row y itself, with the channels taken from the row they are mirrored
+     * from. Only those pixels are read, the rest of both rows belong to other
+     * rows of the image, which another band of an effect pass may be storing.
+     */
+    float tmp[APT_PROW_WIDTH];
+    int x = 0;
+    for (int c = 0; c < 2; c++) {
+        load_span(img, y, buf, x, channels[c] + 1);
+        load_span(img, flip_row(img, y), tmp, channels[c] + 1, channels[c] + APT_CH_WIDTH);
+        mirror_span(buf, tmp, channels[c] + 1, channels[c] + APT_CH_WIDTH, 2 * channels[c] + APT_CH_WIDTH);
+        x = channels[c] + APT_CH_WIDTH;
+    }
+    load_span(img, y, buf, x, APT_PROW_WIDTH);
+    return buf;
+}
+
+void apt_image_store_row(apt_image_t *img, int y, const float *row, int offset, int width) {
+    if (!img->flipped || y == 0) {
+        store_row(img, y, row, offset, width);
+        return;
+    }
+
+    // Pixels up to each channel go to row y, the channel itself is mirrored into its row
+    int x = offset, end = offset + width;
+    for (int c = 0; c <= 2 && x < end; c++) {
+        int begin = (c < 2) ? CLIP(channels[c] + 1, x, end) : end;
+        if (begin > x) store_row(img, y, row, x, begin - x);
+        if (c == 2) break;
+
+        int stop = MIN(channels[c] + APT_CH_WIDTH, end), mirror = 2 * channels[c] + APT_CH_WIDTH;
+        if (stop > begin) {
+            float tmp[APT_PROW_WIDTH];
+            mirror_span(tmp, row, begin, stop, mirror);
+            store_row(img, flip_row(img, y), tmp, mirror - stop + 1, stop - begin);
+        }
+        x = MAX(begin, stop);
+    }
+}
+
+void apt_image_flip(apt_image_t *img) {
+    img->flipped = !img->flipped;
+}
+
+// Rows from each end moved at a time when the pixels really are flipped
+#define FLIP_BLOCK 8
+
+/* Flip the stored pixels of some channels. Rather than swapping pixels
+ * between rows at both ends of the image, a block of rows is read in
+ * (mirrored) from the top and the matching block from the bottom, then
+ * each is written out over the other, so every row is read and written
+ * once, front to back.
+ */
+static void flip_stored(apt_image_t *img, const int *offsets, int nchan, int width) {
+    float spare[2][APT_PROW_WIDTH];
+    float(*rows)[APT_PROW_WIDTH] = (float(*)[APT_PROW_WIDTH])malloc(sizeof(float) * APT_PROW_WIDTH * 2 * FLIP_BLOCK);
+    int block = (rows == NULL) ? 1 : FLIP_BLOCK;
+    if (rows == NULL) rows = spare;
+
+    // Rows 1 to nrow / 2 and the rows they swap with (themselves, for the middle of an even image)
+    for (int y = 1; y <= img->nrow / 2; y += block) {
+        int n = MIN(block, img->nrow / 2 + 1 - y);
+        for (int i = 0; i < 2 * n; i++) {
+            float tmp[APT_PROW_WIDTH];
+            const float *row = load_row(img, (i < n) ? y + i : flip_row(img, y + i - n), tmp);
+            for (int c = 0; c < nchan; c++) mirror_span(rows[i], row, offsets[c] + 1, offsets[c] + width, 2 * offsets[c] + width);
+        }
+        for (int i = 0; i < 2 * n; i++) {
+            int dst = (i < n) ? flip_row(img, y + i) : y + i - n;
+            for (int c = 0; c < nchan; c++) store_row(img, dst, rows[i], offsets[c] + 1, width - 1);
+        }
+    }
+
+    if (rows != spare) free(rows);
+}
+
+void apt_image_apply_flip(apt_image_t *img) {
+    if (!img->flipped) return;
+
+    flip_stored(img, (const int[]){APT_CHA_OFFSET, APT_CHB_OFFSET}, 2, APT_CH_WIDTH);
+    img->flipped = 0;
+}
+
+/* Whole image effects are run as a few sweeps (passes) over the image, each
+ * taking every row through all of its stages while the row is in cache:
+ *  - the point operation of a linear or histogram equalise, worked out from
+ *    the histogram taken by the pass before,
+ *  - denoise, two rows behind the rows being loaded as it looks two rows
+ *    either way (at copies of them, as it only reads the input),
+ *  - the histogram for the next equalise, once a row is finished.
+ * A flip moves no pixels (see apt_image_flip), so it only ends a pass that
+ * denoises, which has to be run the right way up. The point operations and
+ * histograms don't care which way up the image is. That gives the same
+ * result as running the effects one at a time.
+ */
+typedef struct {
+    int apply;    // Stage whose point operation is applied to each row first, or -1
+    int denoise;  // Denoise rows after that
+} pass_t;
+
+// Point operation of an equalise stage, for one channel
+typedef struct {
+    apt_stage_t stage;
+    int min, max;    // Range stretched to 0-255 by APT_STAGE_LINEAR
+    float lut[256];  // APT_STAGE_HISTOGRAM output for each input level
+} point_t;
+
+#define MAX_CHANNELS 2
+
+static void apply_point(const point_t *point, float *row, int offset, int width) {
+    if (point->stage == APT_STAGE_LINEAR) {
+        // Stretch the brightness into the new range
+        for (int x = offset; x < offset + width; x++) {
+            row[x] = (row[x] - point->min) / (point->max - point->min) * 255.0f;
+            row[x] = CLIP(row[x], 0.0f, 255.0f);
+        }
+    } else {
+        for (int x = offset; x < offset + width; x++) row[x] = point->lut[(int)CLIP(row[x], 0, 255)];
+    }
+}
+
+static void make_point(point_t *point, apt_stage_t stage, const int histogram[256], int nrow, int width) {
+    point->stage = stage;
+
+    if (stage == APT_STAGE_LINEAR) {
+        // Find min/max points
+        point->min = point->max = -1;
+        for (int i = 5; i < 250; i++) {
+            if (histogram[i] / width / (nrow / 255.0) > 0.1) {
+                if (point->min == -1) point->min = i;
+                point->max = i;
+            }
+        }
+    } else {
+        // Calculate cumulative frequency
+        long sum = 0, cf[256] = {0};
+        for (int i = 0; i < 255; i++) {
+            sum += histogram[i];
+            cf[i] = sum;
         }
+
+        int area = nrow * width;
+        for (int i = 0; i < 256; i++) point->lut[i] = (256.0f / area) * cf[i];
     }
 }
 
+static void take_histogram(int histogram[256], const float *row, int offset, int width) {
+    for (int x = offset; x < offset + width; x++) histogram[(int)CLIP(row[x], 0, 255)]++;
+}
+
+// Part of a pass, for one thread
+typedef struct {
+    apt_image_t *img;
+    const pass_t *pass;
+    const point_t *points;
+    const int *offsets;
+    int nchan, width;
+    int begin, end;                       // Rows
+    int collect;                          // Take histograms
+    int histograms[MAX_CHANNELS][256];
+    float halo[4][APT_PROW_WIDTH];        // Denoise input from the bands either side, begin - 2 to begin - 1 and end to end + 1
+} band_t;
+
+// Copy of input row y of a band, the rows either side of it were copied before any band started
+static void load_input(band_t *band, int y, float *dst) {
+    const float *row;
+    if (y < band->begin) {
+        row = band->halo[y - (band->begin - 2)];
+    } else if (y >= band->end) {
+        row = band->halo[2 + y - band->end];
+    } else {
+        row = apt_image_load_row(band->img, y, dst);
+    }
+    if (row != dst) memcpy(dst, row, sizeof(float) * APT_PROW_WIDTH);
+}
+
+static int run_band(void *arg) {
+    band_t *band = (band_t *)arg;
+    apt_image_t *img = band->img;
+    const pass_t *pass = band->pass;
+    float buf[5][APT_PROW_WIDTH];
+
+    // Rows y - 4 to y, row y - 2 is denoised into out once row y is loaded
+    float *window[5], out[APT_PROW_WIDTH];
+    int lag = pass->denoise ? 2 : 0;
+    for (int y = pass->denoise ? MAX(band->begin - 2, 0) : band->begin; y < band->end + lag; y++) {
+        if (y < img->nrow) {
+            if (pass->denoise) {
+                load_input(band, y, buf[y % 5]);
+                window[y % 5] = buf[y % 5];
+            } else {
+                window[y % 5] = apt_image_load_row(img, y, buf[y % 5]);
+            }
+            if (pass->apply != -1) {
+                for (int c = 0; c < band->nchan; c++) apply_point(&band->points[c], window[y % 5], band->offsets[c], band->width);
+            }
+        }
+
+        int f = y - lag;
+        if (f < band->begin) continue;
+        float *row = window[f % 5];
+        if (pass->denoise && f >= 2 && f < img->nrow - 2) {
+            float *r[5];
+            for (int i = 0; i < 5; i++) r[i] = window[(f - 2 + i) % 5];
+            for (int c = 0; c < band->nchan; c++) denoise_row(out, r, band->offsets[c], band->width);
+            row = out;
+        }
+        for (int c = 0; c < band->nchan; c++) {
+            if (band->collect) take_histogram(band->histograms[c], row, band->offsets[c], band->width);
+            if (pass->apply != -1 || pass->denoise) apt_image_store_row(img, f, row, band->offsets[c], band->width);
+        }
+    }
+    return 1;
+}
+
+/* Run a pass on up to threads threads, each with its own band of rows and
+ * its own histograms, which are added up at the end. Denoising reads two
+ * rows past either end of a band, which are copied first so the band next
+ * to it can go ahead and overwrite them.
+ */
+static int run_pass(apt_image_t *img, const pass_t *pass, const point_t *points, int (*histograms)[256], const int *offsets,
+                    int nchan, int width, int threads) {
+    int count = img->nrow;
+    if (count == 0) return 1;
+    int nbands = MAX(MIN(threads, count / 64), 1);
+
+    band_t *bands = (band_t *)calloc(nbands, sizeof(band_t));
+    if (bands == NULL) return 0;
+    for (int i = 0; i < nbands; i++) {
+        band_t *band = &bands[i];
+        *band = (band_t){img, pass, points, offsets, nchan, width, count * i / nbands, count * (i + 1) / nbands,
+                         histograms != NULL};
+
+        for (int k = 0; k < 4 && pass->denoise; k++) {
+            int y = (k < 2) ? band->begin - 2 + k : band->end + k - 2;
+            if (y < 0 || y >= img->nrow) continue;
+            const float *row = apt_image_load_row(img, y, band->halo[k]);
+            if (row != band->halo[k]) memcpy(band->halo[k], row, sizeof(float) * APT_PROW_WIDTH);
+        }
+    }
+
+#ifdef APT_HAVE_THREADS
+    // Bands that can't get a thread are run on this one, along with the first
+    thrd_t *ids = (thrd_t *)calloc(nbands, sizeof(thrd_t));
+    int *started = (int *)calloc(nbands, sizeof(int));
+    for (int i = 1; i < nbands && ids != NULL && started != NULL; i++) {
+        started[i] = (thrd_create(&ids[i], run_band, &bands[i]) == thrd_success);
+    }
+    for (int i = 0; i < nbands; i++) {
+        if (started != NULL && started[i]) continue;
+        run_band(&bands[i]);
+    }
+    for (int i = 1; i < nbands && started != NULL; i++) {
+        if (started[i]) thrd_join(ids[i], NULL);
+    }
+    free(ids);
+    free(started);
+#else
+    for (int i = 0; i < nbands; i++) run_band(&bands[i]);
+#endif
+
+    for (int i = 0; i < nbands && histograms != NULL; i++) {
+        for (int c = 0; c < nchan; c++) {
+            for (int k = 0; k < 256; k++) histograms[c][k] += bands[i].histograms[c][k];
+        }
+    }
+    free(bands);
+    return 1;
+}
+
+static int process(apt_image_t *img, const apt_stage_t *stages, int nstages, const int *offsets, int nchan, int width,
+                   int threads) {
+    for (int i = 0; i < nstages; i++) {
+        if (stages[i] < APT_STAGE_DENOISE || stages[i] > APT_STAGE_HISTOGRAM) return 0;
+    }
+
+    // Cut the list into passes, running each as soon as the stage after it is reached
+    point_t points[MAX_CHANNELS];
+    pass_t pass = {-1, 0};
+    for (int i = 0; i <= nstages; i++) {
+        int equalise = (i < nstages) && (stages[i] == APT_STAGE_LINEAR || stages[i] == APT_STAGE_HISTOGRAM);
+        if (i == nstages) {
+            if (pass.apply == -1 && !pass.denoise) break;
+        } else if (stages[i] == APT_STAGE_DENOISE && !pass.denoise) {
+            pass.denoise = 1;
+            continue;
+        } else if (stages[i] == APT_STAGE_FLIP && !pass.denoise) {
+            apt_image_flip(img);
+            continue;
+        }
+
+        int histograms[MAX_CHANNELS][256] = {{0}};
+        if (!run_pass(img, &pass, points, equalise ? histograms : NULL, offsets, nchan, width, threads)) return 0;
+        if (equalise) {
+            for (int c = 0; c < nchan; c++) make_point(&points[c], stages[i], histograms[c], img->nrow, width);
+        }
+
+        // An equalise starts the next pass with its point operation, anything else is tried again on it
+        pass = (pass_t){equalise ? i : -1, 0};
+        if (!equalise && i < nstages) i--;
+    }
+
+    return 1;
+}
+
+int apt_image_process(apt_image_t *img, const apt_stage_t *stages, int nstages, int threads) {
+    return process(img, stages, nstages, (const int[]){APT_CHA_OFFSET, APT_CHB_OFFSET}, 2, APT_CH_WIDTH, threads);
+}
+
+void apt_image_histogramEqualise(apt_image_t *img, int offset, int width) {
+    process(img, (const apt_stage_t[]){APT_STAGE_HISTOGRAM}, 1, &offset, 1, width, 1);
+}
+
+void apt_image_linearEnhance(apt_image_t *img, int offset, int width) {
+    process(img, (const apt_stage_t[]){APT_STAGE_LINEAR}, 1, &offset, 1, width, 1);
+}
+
+void apt_image_denoise(apt_image_t *img, int offset, int width) {
+    process(img, (const apt_stage_t[]){APT_STAGE_DENOISE}, 1, &offset, 1, width, 1);
+}
+
+// Flips the stored pixels of a channel, for northbound passes
+void apt_flipImage(apt_image_t *img, int width, int offset) {
+    flip_stored(img, &offset, 1, width);
+}
+
+// Wrap rows of floats in an image, for the functions that take prow
+static apt_image_t float_image(float **prow, int nrow) {
+    apt_image_t img = {0};
+    img.prow = prow;
+    img.nrow = nrow;
+    img.format = APT_FORMAT_FLOAT;
+    return img;
+}
+
+void apt_histogramEqualise(float **prow, int nrow, int offset, int width) {
+    apt_image_t img = float_image(prow, nrow);
+    apt_image_histogramEqualise(&img, offset, width);
+}
+
+void apt_linearEnhance(float **prow, int nrow, int offset, int width) {
+    apt_image_t img = float_image(prow, nrow);
+    apt_image_linearEnhance(&img, offset, width);
+}
+
+void apt_denoise(float **prow, int nrow, int offset, int width) {
+    apt_image_t img = float_image(prow, nrow);
+    apt_image_denoise(&img, offset, width);
+}
+
 // Calculate crop to reomve noise from the start and end of an image
 int apt_cropNoise(apt_image_t *img) {
 #define NOISE_THRESH 180.0
 
-    // Average value of minute marker
-    float spc_rows[APT_MAX_HEIGHT] = {0.0};
+    // Rows are moved about below, which the mapping of a flipped image can't follow
+    apt_image_apply_flip(img);
+
+    // Average value of minute marker, with zeros either side for the smoothing below
+    float *spc_buffer = (float *)calloc(img->nrow + 5, sizeof(float));
+    if (spc_buffer == NULL) return 0;
+    float *spc_rows = &spc_buffer[1];
     int startCrop = 0;
     int endCrop = img->nrow;
     for (int y = 0; y < img->nrow; y++) {
+        float buf[APT_PROW_WIDTH];
+        const float *row = apt_image_load_row(img, y, buf);
         for (int x = 0; x < APT_SPC_WIDTH; x++) {
-            spc_rows[y] += img->prow[y][x + (APT_CHB_OFFSET - APT_SPC_WIDTH)];
+            spc_rows[y] += row[x + (APT_CHB_OFFSET - APT_SPC_WIDTH)];
         }
         spc_rows[y] /= APT_SPC_WIDTH;
 
@@ -287,11 +885,13 @@ int apt_cropNoise(apt_image_t *img) {
         }
     }
 
+    free(spc_buffer);
+
     // printf("Crop rows: %i -> %i\n", startCrop, endCrop);
 
     // Remove the noisy rows at start
     for (int y = 0; y < img->nrow - startCrop; y++) {
-        memmove(img->prow[y], img->prow[y + startCrop], sizeof(float) * APT_PROW_WIDTH);
+        memmove(row_ptr(img, y), row_ptr(img, y + startCrop), row_bytes(img->format));
     }
 
     // Ignore the noisy rows at the end
@@ -337,15 +937,14 @@ tempparam_t tempcomp(float t[16], int ch, int satnum) {
 }
 
 // IR channel temperature calibration
-static float tempcal(float Ce, int satnum, tempparam_t tpr) {
-    const calibration_t calibration = get_calibration(satnum);
-    const float Ns = calibration.cor[tpr.ch].Ns;
-    const float Vc = calibration.rad[tpr.ch].vc;
-    const float A = calibration.rad[tpr.ch].A;
-    const float B = calibration.rad[tpr.ch].B;
+static float tempcal(float Ce, const calibration_t *calibration, tempparam_t tpr) {
+    const float Ns = calibration->cor[tpr.ch].Ns;
+    const float Vc = calibration->rad[tpr.ch].vc;
+    const float A = calibration->rad[tpr.ch].A;
+    const float B = calibration->rad[tpr.ch].B;
 
     float Nl = Ns + (tpr.Nbb - Ns) * (tpr.Cs - Ce * 4.0) / (tpr.Cs - tpr.Cb);  // Linear radiance estimate
-    float Nc = quadratic_calc(Nl, calibration.cor[tpr.ch].quadratic);          // Non-linear correction
+    float Nc = quadratic_calc(Nl, calibration->cor[tpr.ch].quadratic);         // Non-linear correction
     float Ne = Nl + Nc;                                                        // Corrected radiance
 
     float Testar = C2 * Vc / logf(C1 * powf(Vc, 3) / Ne + 1.0);  // Equivlent black body temperature
@@ -357,17 +956,51 @@ static float tempcal(float Ce, int satnum, tempparam_t tpr) {
     return (Te + 100.0) / 160.0 * 255.0;
 }
 
-// Temperature calibration wrapper
-void apt_calibrate_thermal(int satnum, apt_image_t *img, int offset, int width) {
-    tempparam_t temp = tempcomp(tele, img->chB, satnum);
+/* A calibration only depends on the pixel value (and the telemetry of the
+ * image), so instead of working it out for every pixel it is planned once
+ * per image, at every quarter of a level (the resolution of the 10 bit
+ * AVHRR counts) from 0 to 256. Applying the plan is then a lookup with
+ * linear interpolation, exact for whole levels (8 bit images).
+ */
+#define PLAN_STEPS 4
+#define PLAN_SIZE (256 * PLAN_STEPS + 1)
+
+static void apply_plan_row(float *row, const float plan[PLAN_SIZE], int offset, int width) {
+    for (int x = offset; x < offset + width; x++) {
+        float pos = CLIP(row[x], 0.0f, 255.0f) * PLAN_STEPS;
+        int k = (int)pos;
+        row[x] = plan[k] + (plan[k + 1] - plan[k]) * (pos - k);
+    }
+}
 
+static void apply_plan(apt_image_t *img, const float plan[PLAN_SIZE], int offset, int width) {
     for (int y = 0; y < img->nrow; y++) {
-        for (int x = 0; x < width; x++) {
-            img->prow[y][x + offset] = (float)tempcal(img->prow[y][x + offset], satnum, temp);
-        }
+        float buf[APT_PROW_WIDTH];
+        float *row = apt_image_load_row(img, y, buf);
+        apply_plan_row(row, plan, offset, width);
+        apt_image_store_row(img, y, row, offset, width);
+    }
+}
+
+// Plan the temperature calibration of thermal channel ch, t being its telemetry
+static void thermal_plan(float plan[PLAN_SIZE], int satnum, apt_channel_t ch, float t[16]) {
+    const calibration_t calibration = get_calibration(satnum);
+    tempparam_t temp = tempcomp(t, ch, satnum);
+
+    // Only 0-255 is shown, and past the point where the radiance goes negative (NaN) is as cold as it gets
+    for (int i = 0; i < PLAN_SIZE; i++) {
+        float te = tempcal((float)i / PLAN_STEPS, &calibration, temp);
+        plan[i] = isnan(te) ? 0.0f : clamp(te, 255.0f, 0.0f);
     }
 }
 
+// Temperature calibration wrapper
+void apt_calibrate_thermal(int satnum, apt_image_t *img, int offset, int width) {
+    float plan[PLAN_SIZE];
+    thermal_plan(plan, satnum, img->chB, tele);
+    apply_plan(img, plan, offset, width);
+}
+
 float calibrate_pixel(float value, int channel, calibration_t cal) {
     if (value > cal.visible[channel].cutoff) {
         return linear_calc(value * 4.0f, cal.visible[channel].high) * 255.0f / 100.0f;
@@ -376,13 +1009,194 @@ float calibrate_pixel(float value, int channel, calibration_t cal) {
     }
 }
 
-void apt_calibrate_visible(int satnum, apt_image_t *img, int offset, int width) {
+static void visible_plan(float plan[PLAN_SIZE], int satnum, apt_channel_t ch) {
     const calibration_t calibration = get_calibration(satnum);
-    int channel = img->chA - 1;
 
-    for (int y = 0; y < img->nrow; y++) {
-        for (int x = 0; x < width; x++) {
-            img->prow[y][x + offset] = clamp(calibrate_pixel(img->prow[y][x + offset], channel, calibration), 255.0f, 0.0f);
+    for (int i = 0; i < PLAN_SIZE; i++) {
+        plan[i] = clamp(calibrate_pixel((float)i / PLAN_STEPS, ch - 1, calibration), 255.0f, 0.0f);
+    }
+}
+
+void apt_calibrate_visible(int satnum, apt_image_t *img, int offset, int width) {
+    float plan[PLAN_SIZE];
+    visible_plan(plan, satnum, img->chA);
+    apply_plan(img, plan, offset, width);
+}
+
+// --- Realtime telemetry --- //
+
+/* apt_calibrate looks at the whole image at once. While a pass is still
+ * being decoded the telemetry is tracked a row at a time instead: every row
+ * scores the step from wedge 7 (white) to wedge 8 (black) at its place in
+ * the frame, and the place with the highest total so far is taken as where
+ * frames start. Each time a frame is complete its wedges are measured, and
+ * if it is less noisy than the best frame so far it becomes the calibration.
+ * Rows are held back a frame, so the calibration of a row comes from a frame
+ * at least as late as the row itself.
+ */
+
+// Rows held back at most, when no frame has been found yet
+#define TRACK_ROWS (3 * APT_FRAME_LEN)
+
+// Telemetry of one channel
+typedef struct {
+    int offset;
+    float teleline[APT_FRAME_LEN];  // Average telemetry of each of the last APT_FRAME_LEN rows, by row number
+    float step[APT_FRAME_LEN];      // Total wedge 7 to 8 step at each row of the frame
+    float noise;                    // Noise of the best frame, -1 until one is found
+    linear_t regr;
+    float tele[16];
+    apt_channel_t channel;
+} track_t;
+
+struct apt_telemetry {
+    int satnum;
+    track_t tracks[2];
+    int nrow;                          // Rows pushed
+    int held;                          // Rows held back, the last ones pushed
+    float (*rows)[APT_PROW_WIDTH];     // Held back rows, by row number
+    float thermal[PLAN_SIZE];          // Planned with the best frame, see apt_telemetry_calibrate_thermal
+    float visible[PLAN_SIZE];
+};
+
+apt_telemetry_t *apt_telemetry_create(int satnum) {
+    apt_telemetry_t *tel = (apt_telemetry_t *)calloc(1, sizeof(apt_telemetry_t));
+    if (tel == NULL) return NULL;
+
+    tel->rows = (float(*)[APT_PROW_WIDTH])malloc(sizeof(float) * APT_PROW_WIDTH * TRACK_ROWS);
+    if (tel->rows == NULL) {
+        free(tel);
+        return NULL;
+    }
+
+    tel->satnum = satnum;
+    for (int c = 0; c < 2; c++) {
+        tel->tracks[c].offset = (c == 0) ? APT_CHA_OFFSET : APT_CHB_OFFSET;
+        tel->tracks[c].noise = -1.0f;
+        tel->tracks[c].channel = APT_CHANNEL_UNKNOWN;
+    }
+    return tel;
+}
+
+void apt_telemetry_free(apt_telemetry_t *tel) {
+    if (tel == NULL) return;
+    free(tel->rows);
+    free(tel);
+}
+
+// Take in row y of a channel, measuring the frame that ends with it if that's where frames end
+static void track_row(track_t *track, const float *row, int y) {
+    float *teleline = track->teleline;
+    teleline[y % APT_FRAME_LEN] = 0.0f;
+    for (int x = 3; x < 43; x++) teleline[y % APT_FRAME_LEN] += row[x + track->offset + APT_CH_WIDTH];
+    teleline[y % APT_FRAME_LEN] /= 40.0f;
+
+    // (sum 4px below) - (sum 4px above) of the row that is now 4 rows clear of the edges
+    int n = y - 3;
+    if (n >= 4) {
+        float df = 0.0f;
+        for (int i = 1; i <= 4; i++) df += teleline[(n - i) % APT_FRAME_LEN] - teleline[(n + i - 1) % APT_FRAME_LEN];
+        track->step[n % APT_FRAME_LEN] += df;
+    }
+    if (y + 1 < APT_FRAME_LEN) return;
+
+    // Wedge 8 starts 64 rows into a frame
+    int edge = 0;
+    for (int i = 1; i < APT_FRAME_LEN; i++) {
+        if (track->step[i] > track->step[edge]) edge = i;
+    }
+    int start = y + 1 - APT_FRAME_LEN;
+    if (track->step[edge] <= 0.0f || (start + 64) % APT_FRAME_LEN != edge) return;
+
+    float wedge[16];
+    for (int j = 0; j < 16; j++) {
+        wedge[j] = 0.0f;
+        for (int i = 1; i < 7; i++) wedge[j] += teleline[(start + j * 8 + i) % APT_FRAME_LEN];
+        wedge[j] /= 6;
+    }
+
+    float noise = teleNoise(wedge);
+    if (track->noise >= 0.0f && noise >= track->noise) return;
+    track->noise = noise;
+    track->regr = compute_regression(wedge);
+    for (int j = 0; j < 16; j++) track->tele[j] = linear_calc(wedge[j], track->regr);
+
+    // Closest of the reference wedges to the channel ID wedge
+    float min = -1;
+    for (int j = 0; j < 6; j++) {
+        float df = (track->tele[15] - track->tele[j]) * (track->tele[15] - track->tele[j]);
+        if (df < min || min == -1) {
+            track->channel = (apt_channel_t)(j + 1);
+            min = df;
+        }
+    }
+}
+
+// Give out the oldest row held back, brightness calibrated like apt_calibrate
+static void release_row(apt_telemetry_t *tel, float *out) {
+    memcpy(out, tel->rows[(tel->nrow - tel->held) % TRACK_ROWS], sizeof(float) * APT_PROW_WIDTH);
+    tel->held--;
+
+    for (int c = 0; c < 2; c++) {
+        const track_t *track = &tel->tracks[c];
+        if (track->noise < 0.0f) continue;
+
+        int begin = track->offset - APT_SYNC_WIDTH - APT_SPC_WIDTH, end = track->offset + APT_CH_WIDTH + APT_TELE_WIDTH;
+        for (int x = begin; x < end; x++) out[x] = CLIP(linear_calc(out[x], track->regr), 0, 255);
+    }
+}
+
+int apt_telemetry_push_row(apt_telemetry_t *tel, const float *row, float *out) {
+    memcpy(tel->rows[tel->nrow % TRACK_ROWS], row, sizeof(float) * APT_PROW_WIDTH);
+    tel->held++;
+
+    for (int c = 0; c < 2; c++) {
+        track_t *track = &tel->tracks[c];
+        apt_channel_t channel = track->channel;
+        float noise = track->noise;
+        track_row(track, row, tel->nrow);
+
+        // Plan with the new frame
+        if (track->noise == noise) continue;
+        if (c == 1 && track->channel >= APT_CHANNEL_4) {
+            thermal_plan(tel->thermal, tel->satnum, track->channel, track->tele);
+        }
+        if (c == 0 && channel != track->channel && track->channel >= APT_CHANNEL_1 && track->channel <= APT_CHANNEL_2) {
+            visible_plan(tel->visible, tel->satnum, track->channel);
         }
     }
+    tel->nrow++;
+
+    // Once both channels have a frame (or there's no room to wait any longer)
+    int found = tel->tracks[0].noise >= 0.0f && tel->tracks[1].noise >= 0.0f;
+    if ((found && tel->held > APT_FRAME_LEN) || tel->held == TRACK_ROWS) {
+        release_row(tel, out);
+        return 1;
+    }
+    return 0;
+}
+
+int apt_telemetry_flush(apt_telemetry_t *tel, float *out) {
+    if (tel->held == 0) return 0;
+    release_row(tel, out);
+    return 1;
 }
+
+void apt_telemetry_get_channels(const apt_telemetry_t *tel, apt_channel_t *chA, apt_channel_t *chB) {
+    *chA = tel->tracks[0].channel;
+    *chB = tel->tracks[1].channel;
+}
+
+int apt_telemetry_calibrate_thermal(const apt_telemetry_t *tel, float *row) {
+    if (tel->tracks[1].channel < APT_CHANNEL_4) return 0;
+    apply_plan_row(row, tel->thermal, APT_CHB_OFFSET, APT_CH_WIDTH);
+    return 1;
+}
+
+int apt_telemetry_calibrate_visible(const apt_telemetry_t *tel, float *row) {
+    apt_channel_t ch = tel->tracks[0].channel;
+    if (ch < APT_CHANNEL_1 || ch > APT_CHANNEL_2) return 0;
+    apply_plan_row(row, tel->visible, APT_CHA_OFFSET, APT_CH_WIDTH);
+    return 1;
+}
+
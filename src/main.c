@@ -36,17 +36,132 @@
 #include "common.h"
 #include "image.h"
 #include "pngio.h"
+#include "ring.h"
 #include "util.h"
 
+#ifdef APT_HAVE_THREADS
+#include <threads.h>
+#endif
+
 // Audio file
 static SNDFILE *audioFile;
 // Number of channels in audio file
 int channels = 1;
+// Sample rate and length of audio file
+static int samplerate;
+static sf_count_t frames;
 
 // Function declarations
-static int initsnd(char *filename);
+static apt_decoder_t *initsnd(char *filename, options_t *opts);
 int getsamples(void *context, float *samples, int nb);
+static int readSamples(SNDFILE *file, int nchannels, float *buf, float *samples, int nb);
 static int processAudio(char *filename, options_t *opts);
+// Rows decoded per call to apt_decoder_getpixelrows
+#define DECODE_BATCH 64
+
+// Mapping between wedge value and channel ID
+static const struct {
+    char *id[7];
+    char *name[7];
+} ch = {{"?", "1", "2", "3A", "4", "5", "3B"},
+        {"unknown", "visble", "near-infrared", "near-infrared", "thermal-infrared", "thermal-infrared", "mid-infrared"}};
+
+// Images that can be written as the pass is decoded, the calibrated ones a frame (64 seconds) behind, see startStream
+static const char streamTypes[5] = {Raw_Image, Channel_A, Channel_B, Temperature, Visible};
+
+typedef struct {
+    int final;                   // The images of the pass, rather than realtime previews
+    writer_t *raw;               // Unprocessed rows, in realtime mode
+    apt_telemetry_t *telemetry;  // NULL unless a calibrated image was asked for
+    int started;                 // The calibrated images have been opened
+    writer_t *images[5];         // Calibrated images, by streamTypes
+    int rows;                    // Calibrated rows written
+} stream_t;
+
+static int streamable(options_t *opts);
+static void startStream(stream_t *stream, options_t *opts, apt_image_t *img, int final);
+static void streamRow(stream_t *stream, options_t *opts, apt_image_t *img, const float *row);
+static void stopStream(stream_t *stream, options_t *opts, apt_image_t *img);
+
+// Most images a pass is written as (raw, palette, channels A and B, temperature and visible)
+#define MAX_PRODUCTS 6
+
+// An image of the whole pass to write, see renderProduct
+typedef struct {
+    char type;
+    int offset;
+    int width;
+    char desc[60];
+    char *palette;
+} product_t;
+
+// Images being written, on a pool of threads when there's more than one job, see startRender
+typedef struct {
+    options_t *opts;
+    apt_image_t *img;
+    product_t products[MAX_PRODUCTS];
+    int nproducts;  // Products queued
+    int next;       // Next product to write
+    int copying;    // Queued temperature and visible products yet to take their copy of the image
+    int closed;     // Nothing more will be queued
+    int failed;
+    int nthreads;   // 0 when writing on this thread as products are queued
+    int jobs;       // Threads each product is deflated on
+#ifdef APT_HAVE_THREADS
+    thrd_t threads[MAX_PRODUCTS];
+    mtx_t lock;
+    cnd_t wake;
+#endif
+} render_t;
+
+static void startRender(render_t *render, options_t *opts, apt_image_t *img, int nproducts);
+static void queueProduct(render_t *render, char type, int offset, int width, const char *desc, const char *palette);
+static void waitForCopies(render_t *render);
+static int finishRender(render_t *render);
+
+static void decodeSerial(apt_decoder_t *decoder, options_t *opts, apt_image_t *img, stream_t *stream);
+static int copyImage(apt_image_t *dst, const apt_image_t *src);
+
+#ifdef APT_HAVE_THREADS
+// Size of the rings between threads and of the chunks passed through them
+#define PIPELINE_RING_SIZE 65536
+#define PIPELINE_CHUNK 4096
+
+// Threads and buffers of a pipelined decode, see startPipeline
+typedef struct {
+    apt_decoder_t *demodulator;
+    ring_t samples;    // Reader to demodulator
+    ring_t amplitude;  // Demodulator to row assembly
+    thrd_t reader_thread;
+    thrd_t demod_thread;
+} pipeline_t;
+
+static int startPipeline(pipeline_t *pipeline, apt_decoder_t *decoder, options_t *opts);
+static void stopPipeline(pipeline_t *pipeline);
+static int ringGetsamples(void *context, float *samples, int nb);
+
+// Seconds decoded before the start of each segment so the PLL and sync can lock, and after the end to finish the last row
+#define SEGMENT_WARMUP 30.0
+#define SEGMENT_MARGIN 1.0
+
+// A part of the audio file decoded on its own thread, see decodeParallel
+typedef struct {
+    options_t *opts;
+    SNDFILE *file;
+    int channels;
+    float *buf;
+    sf_count_t start;      // First frame
+    sf_count_t remaining;  // Frames left to read
+
+    // Decoded rows (APT_PROW_WIDTH apart) and the timing of each, relative to the start of the segment
+    float *rows;
+    apt_row_info_t *info;
+    int nrow;
+    int maxrow;
+} segment_t;
+
+static int decodeParallel(char *filename, options_t *opts, apt_image_t *img);
+#endif
 
 #ifdef _MSC_VER
 // Functions not supported by MSVC
@@ -64,8 +179,9 @@ static char *basename(char *path) {
 #endif
 
 int main(int argc, const char **argv) {
-    options_t opts = {
-        .type = "r", .effects = "", .satnum = 19, .path = ".", .realtime = 0, .filename = "", .palette = "", .gamma = 1.0};
+    options_t opts = {.type = "r", .effects = "", .satnum = 19, .path = ".", .realtime = 0, .filename = "", .palette = "",
+                      .gamma = 1.0, .fast_pll = 0, .pipeline = 0, .stream = 0,
+                      .jobs = 1, .bits = 0};
 
     static const char *const usages[] = {
         "aptdec [options] [[--] sources]",
@@ -90,6 +206,11 @@ int main(int argc, const char **argv) {
 
         OPT_GROUP("Misc"),
         OPT_BOOLEAN('r', "realtime", &opts.realtime, "decode in realtime", NULL, 0, 0),
+        OPT_BOOLEAN(0, "fast-pll", &opts.fast_pll, "use a faster, approximate PLL (for high sample rates)", NULL, 0, 0),
+        OPT_BOOLEAN(0, "pipeline", &opts.pipeline, "read, demodulate and assemble rows on separate threads", NULL, 0, 0),
+        OPT_BOOLEAN(0, "stream", &opts.stream, "write images as the pass is decoded, without keeping it in memory", NULL, 0, 0),
+        OPT_INTEGER('j', "jobs", &opts.jobs, "threads to use, for decoding segments, effects and writing images", NULL, 0, 0),
+        OPT_INTEGER(0, "bits", &opts.bits, "keep calibrated images as 8 or 16 bit pixels to save memory", NULL, 0, 0),
         OPT_END(),
     };
 
@@ -115,18 +236,14 @@ int main(int argc, const char **argv) {
 
 static int processAudio(char *filename, options_t *opts) {
     // Image info struct
-    apt_image_t img;
-
-    // Mapping between wedge value and channel ID
-    static struct {
-        char *id[7];
-        char *name[7];
-    } ch = {{"?", "1", "2", "3A", "4", "5", "3B"},
-            {"unknown", "visble", "near-infrared", "near-infrared", "thermal-infrared", "thermal-infrared", "mid-infrared"}};
+    apt_image_t img = {0};
 
     // Buffer for image channel
     char desc[60];
 
+    // Images written as the pass is decoded
+    stream_t stream = {0};
+
     // Parse file path
     char path[256], extension[32];
     strcpy(path, filename);
@@ -139,41 +256,67 @@ static int processAudio(char *filename, options_t *opts) {
         time(&t);
         strncpy(img.name, ctime(&t), 24);
 
-        // Init a row writer
-        initWriter(opts, &img, APT_IMG_WIDTH, APT_MAX_HEIGHT, "Unprocessed realtime image", "r");
+        // Init the row writers
+        startStream(&stream, opts, &img, 0);
+    }
+
+    // Write the images straight from the decoder when nothing needs the whole pass
+    int streaming = opts->stream && !opts->realtime && strcmp(extension, "png") != 0 && streamable(opts);
+    if (opts->stream && !opts->realtime && !streaming) warning("These images need the whole pass, not streaming them");
+    if (streaming) {
+        startStream(&stream, opts, &img, 1);
+
+        // Without the tracker the images can only be made from the whole pass
+        if (stream.telemetry == NULL) streaming = 0;
     }
 
     if (strcmp(extension, "png") == 0) {
         // Read PNG into image buffer
         printf("Reading %s\n", filename);
-        if (readRawImage(filename, img.prow, &img.nrow) == 0) {
+        if (readRawImage(filename, &img) == 0) {
             exit(EPERM);
         }
     } else {
         // Attempt to open the audio file
-        if (initsnd(filename) == 0) exit(EPERM);
-
-        // Build image
-        // TODO: multithreading, would require some sort of input buffer
-        for (img.nrow = 0; img.nrow < APT_MAX_HEIGHT; img.nrow++) {
-            // Allocate memory for this row
-            img.prow[img.nrow] = (float *)malloc(sizeof(float) * APT_PROW_WIDTH);
-
-            // Write into memory and break the loop when there are no more samples to read
-            if (apt_getpixelrow(img.prow[img.nrow], img.nrow, &img.zenith, (img.nrow == 0), getsamples, NULL) == 0) break;
-
-            if (opts->realtime) pushRow(img.prow[img.nrow], APT_IMG_WIDTH);
+        apt_decoder_t *decoder = initsnd(filename, opts);
+        if (decoder == NULL) exit(EPERM);
+
+        // Room for every row of the file (2 per second), the image grows if that turns out to be too few
+        double seconds = (double)frames / samplerate;
+        int rows = (int)(seconds * 2.0) + 4;
+        if (opts->realtime || streaming || seconds <= 0.0 || seconds > 86400.0) rows = APT_IMAGE_CHUNK;
+        if (!apt_image_alloc(&img, rows)) {
+            error_noexit("Could not allocate the image");
+            exit(ENOMEM);
+        }
 
-            fprintf(stderr, "Row: %d\r", img.nrow);
-            fflush(stderr);
+        // Split the file into segments decoded in parallel, or decode it in one go
+        int decoded = 0;
+        if (opts->jobs > 1) {
+#ifdef APT_HAVE_THREADS
+            if (opts->realtime) {
+                warning("Realtime decoding can't be split into segments, using a single thread");
+            } else {
+                decoded = decodeParallel(filename, opts, &img);
+            }
+#else
+            warning("Not built with thread support, using a single thread");
+#endif
         }
+        if (!decoded) decodeSerial(decoder, opts, &img, (opts->realtime || streaming) ? &stream : NULL);
 
         // Close stream
         sf_close(audioFile);
+        apt_decoder_free(decoder);
     }
 
-    if (opts->realtime) closeWriter();
+    if (opts->realtime || streaming) stopStream(&stream, opts, &img);
 
+    if (streaming) {
+        printf("Total rows: %d\n", stream.rows);
+        apt_image_free(&img);
+        return 1;
+    }
     printf("Total rows: %d\n", img.nrow);
 
     // Calibrate
@@ -182,135 +325,692 @@ static int processAudio(char *filename, options_t *opts) {
     printf("Channel A: %s (%s)\n", ch.id[img.chA], ch.name[img.chA]);
     printf("Channel B: %s (%s)\n", ch.id[img.chB], ch.name[img.chB]);
 
+    // Everything from here on is 0-255, so it can be kept in fewer bits
+    if (opts->bits == 8 || opts->bits == 16) {
+        if (!apt_image_compact(&img, opts->bits == 8 ? APT_FORMAT_U8 : APT_FORMAT_U16)) warning("Could not compact the image");
+    } else if (opts->bits != 0) {
+        warning("Pixels can only be kept in 8 or 16 bits, using floats");
+    }
+
     // Crop noise from start and end of image
     if (CONTAINS(opts->effects, Crop_Noise)) {
         img.zenith -= apt_cropNoise(&img);
     }
 
-    // Denoise
-    if (CONTAINS(opts->effects, Denoise)) {
-        apt_denoise(img.prow, img.nrow, APT_CHA_OFFSET, APT_CH_WIDTH);
-        apt_denoise(img.prow, img.nrow, APT_CHB_OFFSET, APT_CH_WIDTH);
-    }
-
+    // Whole image effects, run as one list so the image is swept as few times as possible
+    apt_stage_t stages[4];
+    int nstages = 0;
+    if (CONTAINS(opts->effects, Denoise)) stages[nstages++] = APT_STAGE_DENOISE;
     // Flip, for northbound passes
-    if (CONTAINS(opts->effects, Flip_Image)) {
-        apt_flipImage(&img, APT_CH_WIDTH, APT_CHA_OFFSET);
-        apt_flipImage(&img, APT_CH_WIDTH, APT_CHB_OFFSET);
-    }
-
-    // Temperature
-    if (CONTAINS(opts->type, Temperature) && img.chB >= 4) {
-        // Create another buffer as to not modify the orignal
-        apt_image_t tmpimg = img;
-        for (int i = 0; i < img.nrow; i++) {
-            tmpimg.prow[i] = (float *)malloc(sizeof(float) * APT_PROW_WIDTH);
-            memcpy(tmpimg.prow[i], img.prow[i], sizeof(float) * APT_PROW_WIDTH);
-        }
-
-        // Perform temperature calibration
-        apt_calibrate_thermal(opts->satnum, &tmpimg, APT_CHB_OFFSET, APT_CH_WIDTH);
-        ImageOut(opts, &tmpimg, APT_CHB_OFFSET, APT_CH_WIDTH, "Temperature", Temperature, (char *)apt_TempPalette);
-    }
-
-    // Visible
-    if (CONTAINS(opts->type, Visible) && img.chA <= 2) {
-        // Create another buffer as to not modify the orignal
-        apt_image_t tmpimg = img;
-        for (int i = 0; i < img.nrow; i++) {
-            tmpimg.prow[i] = (float *)malloc(sizeof(float) * APT_PROW_WIDTH);
-            memcpy(tmpimg.prow[i], img.prow[i], sizeof(float) * APT_PROW_WIDTH);
-        }
-
-        // Perform visible calibration
-        apt_calibrate_visible(opts->satnum, &tmpimg, APT_CHA_OFFSET, APT_CH_WIDTH);
-        ImageOut(opts, &tmpimg, APT_CHA_OFFSET, APT_CH_WIDTH, "Visible", Visible, NULL);
-    }
-
-    // Linear equalise
-    if (CONTAINS(opts->effects, Linear_Equalise)) {
-        apt_linearEnhance(img.prow, img.nrow, APT_CHA_OFFSET, APT_CH_WIDTH);
-        apt_linearEnhance(img.prow, img.nrow, APT_CHB_OFFSET, APT_CH_WIDTH);
-    }
-
-    // Histogram equalise
-    if (CONTAINS(opts->effects, Histogram_Equalise)) {
-        apt_histogramEqualise(img.prow, img.nrow, APT_CHA_OFFSET, APT_CH_WIDTH);
-        apt_histogramEqualise(img.prow, img.nrow, APT_CHB_OFFSET, APT_CH_WIDTH);
-    }
+    if (CONTAINS(opts->effects, Flip_Image)) stages[nstages++] = APT_STAGE_FLIP;
+    int split = nstages;
+    if (CONTAINS(opts->effects, Linear_Equalise)) stages[nstages++] = APT_STAGE_LINEAR;
+    if (CONTAINS(opts->effects, Histogram_Equalise)) stages[nstages++] = APT_STAGE_HISTOGRAM;
+
+    // The temperature and visible images are taken before equalising, so that needs the list cutting in two
+    int temperature = CONTAINS(opts->type, Temperature) && img.chB >= 4;
+    int visible = CONTAINS(opts->type, Visible) && img.chA <= 2;
+    if (!temperature && !visible) split = nstages;
+    apt_image_process(&img, stages, split, opts->jobs);
+
+    // Write the images, the temperature and visible ones calibrate their own copy of the image
+    img.palette = opts->palette;
+    int nproducts = temperature + visible + CONTAINS(opts->type, Raw_Image) + CONTAINS(opts->type, Palleted) +
+                    CONTAINS(opts->type, Channel_A) + CONTAINS(opts->type, Channel_B);
+    render_t render;
+    startRender(&render, opts, &img, nproducts);
+    if (temperature) queueProduct(&render, Temperature, APT_CHB_OFFSET, APT_CH_WIDTH, "Temperature", apt_TempPalette);
+    if (visible) queueProduct(&render, Visible, APT_CHA_OFFSET, APT_CH_WIDTH, "Visible", NULL);
+
+    // Linear and histogram equalise, once those copies have been taken
+    waitForCopies(&render);
+    apt_image_process(&img, &stages[split], nstages - split, opts->jobs);
 
     // Raw image
     if (CONTAINS(opts->type, Raw_Image)) {
         sprintf(desc, "%s (%s) & %s (%s)", ch.id[img.chA], ch.name[img.chA], ch.id[img.chB], ch.name[img.chB]);
-        ImageOut(opts, &img, 0, APT_IMG_WIDTH, desc, Raw_Image, NULL);
+        queueProduct(&render, Raw_Image, 0, APT_IMG_WIDTH, desc, NULL);
     }
 
     // Palette image
     if (CONTAINS(opts->type, Palleted)) {
-        img.palette = opts->palette;
-        strcpy(desc, "Palette composite");
-        ImageOut(opts, &img, APT_CHA_OFFSET, APT_CH_WIDTH, desc, Palleted, NULL);
+        queueProduct(&render, Palleted, APT_CHA_OFFSET, APT_CH_WIDTH, "Palette composite", NULL);
     }
 
     // Channel A
     if (CONTAINS(opts->type, Channel_A)) {
         sprintf(desc, "%s (%s)", ch.id[img.chA], ch.name[img.chA]);
-        ImageOut(opts, &img, APT_CHA_OFFSET, APT_CH_WIDTH, desc, Channel_A, NULL);
+        queueProduct(&render, Channel_A, APT_CHA_OFFSET, APT_CH_WIDTH, desc, NULL);
     }
 
     // Channel B
     if (CONTAINS(opts->type, Channel_B)) {
         sprintf(desc, "%s (%s)", ch.id[img.chB], ch.name[img.chB]);
-        ImageOut(opts, &img, APT_CHB_OFFSET, APT_CH_WIDTH, desc, Channel_B, NULL);
+        queueProduct(&render, Channel_B, APT_CHB_OFFSET, APT_CH_WIDTH, desc, NULL);
     }
 
+    // Whatever couldn't be written has been reported
+    int rendered = finishRender(&render);
+    apt_image_free(&img);
+    return rendered;
+}
+
+// Give dst its own copy of the rows of src
+static int copyImage(apt_image_t *dst, const apt_image_t *src) {
+    if (!apt_image_copy(dst, src)) {
+        error_noexit("Could not allocate the image");
+        return 0;
+    }
     return 1;
 }
 
+// A temperature or visible product has its copy of the image, so equalising can go ahead
+static void productCopied(render_t *render) {
+#ifdef APT_HAVE_THREADS
+    if (render->nthreads > 0) {
+        mtx_lock(&render->lock);
+        render->copying--;
+        cnd_broadcast(&render->wake);
+        mtx_unlock(&render->lock);
+        return;
+    }
+#endif
+    render->copying--;
+}
+
+// Write an image of the pass, only reading the shared image so products can be written side by side
+static int renderProduct(render_t *render, product_t *product) {
+    apt_image_t *img = render->img;
+    if (product->type != Temperature && product->type != Visible) {
+        return ImageOut(render->opts, img, product->offset, product->width, product->desc, product->type, product->palette,
+                        render->jobs);
+    }
+
+    // Create another buffer as to not modify the orignal
+    apt_image_t tmpimg = *img;
+    int copied = copyImage(&tmpimg, img);
+    productCopied(render);
+    if (!copied) return 0;
+
+    // Perform temperature or visible calibration
+    if (product->type == Temperature) {
+        apt_calibrate_thermal(render->opts->satnum, &tmpimg, product->offset, product->width);
+    } else {
+        apt_calibrate_visible(render->opts->satnum, &tmpimg, product->offset, product->width);
+    }
+    int ok = ImageOut(render->opts, &tmpimg, product->offset, product->width, product->desc, product->type, product->palette,
+                      render->jobs);
+    apt_image_free(&tmpimg);
+    return ok;
+}
+
+#ifdef APT_HAVE_THREADS
+// Write products as they're queued, until the queue is closed and empty
+static int renderThread(void *arg) {
+    render_t *render = (render_t *)arg;
+
+    mtx_lock(&render->lock);
+    while (1) {
+        while (render->next == render->nproducts && !render->closed) cnd_wait(&render->wake, &render->lock);
+        if (render->next == render->nproducts) break;
+
+        product_t *product = &render->products[render->next++];
+        mtx_unlock(&render->lock);
+        int ok = renderProduct(render, product);
+        mtx_lock(&render->lock);
+        if (!ok) render->failed = 1;
+    }
+    mtx_unlock(&render->lock);
+    return 0;
+}
+#endif
+
+/* Images of the whole pass are mostly deflating, which is one thread per
+ * image, so with more than one job they're written on a pool of up to a
+ * thread each, sharing the image read only. The jobs left over go to the
+ * deflate bands of each image (see writeImage), so the two don't add up to
+ * more threads than asked for. Equalising changes the image,
+ * so the temperature and visible images (taken before it) are queued first
+ * and it waits for their copies, see waitForCopies. Products all go to the
+ * same file when one is given, so those are written in order on this thread.
+ */
+static void startRender(render_t *render, options_t *opts, apt_image_t *img, int nproducts) {
+    memset(render, 0, sizeof(render_t));
+    render->opts = opts;
+    render->img = img;
+    render->jobs = opts->jobs;
+
+#ifdef APT_HAVE_THREADS
+    int nthreads = MIN(MIN(opts->jobs, nproducts), MAX_PRODUCTS);
+    if (nthreads <= 1 || (opts->filename != NULL && opts->filename[0] != '\0')) return;
+    if (mtx_init(&render->lock, mtx_plain) != thrd_success) return;
+    if (cnd_init(&render->wake) != thrd_success) {
+        mtx_destroy(&render->lock);
+        return;
+    }
+
+    // Whatever threads can't be started, the rest share the work
+    for (int i = 0; i < nthreads; i++) {
+        if (thrd_create(&render->threads[render->nthreads], renderThread, render) == thrd_success) render->nthreads++;
+    }
+    if (render->nthreads == 0) {
+        cnd_destroy(&render->wake);
+        mtx_destroy(&render->lock);
+        return;
+    }
+    render->jobs = MAX(opts->jobs / render->nthreads, 1);
+#else
+    (void)nproducts;
+#endif
+}
+
+static void queueProduct(render_t *render, char type, int offset, int width, const char *desc, const char *palette) {
+    product_t product = {.type = type, .offset = offset, .width = width, .palette = (char *)palette};
+    snprintf(product.desc, sizeof(product.desc), "%s", desc);
+    int copies = (type == Temperature || type == Visible);
+
+#ifdef APT_HAVE_THREADS
+    if (render->nthreads > 0) {
+        mtx_lock(&render->lock);
+        render->products[render->nproducts++] = product;
+        render->copying += copies;
+        cnd_broadcast(&render->wake);
+        mtx_unlock(&render->lock);
+        return;
+    }
+#endif
+
+    render->products[render->nproducts] = product;
+    render->copying += copies;
+    if (!renderProduct(render, &render->products[render->nproducts++])) render->failed = 1;
+}
+
+static void waitForCopies(render_t *render) {
+#ifdef APT_HAVE_THREADS
+    if (render->nthreads > 0) {
+        mtx_lock(&render->lock);
+        while (render->copying > 0) cnd_wait(&render->wake, &render->lock);
+        mtx_unlock(&render->lock);
+    }
+#else
+    (void)render;
+#endif
+}
+
+// Wait for every product to be written, returns 0 if any couldn't be
+static int finishRender(render_t *render) {
+#ifdef APT_HAVE_THREADS
+    if (render->nthreads > 0) {
+        mtx_lock(&render->lock);
+        render->closed = 1;
+        cnd_broadcast(&render->wake);
+        mtx_unlock(&render->lock);
+
+        for (int i = 0; i < render->nthreads; i++) thrd_join(render->threads[i], NULL);
+        cnd_destroy(&render->wake);
+        mtx_destroy(&render->lock);
+    }
+#endif
+    return !render->failed;
+}
+
+// Whether every image and effect asked for can be made a row at a time, so the pass needn't be kept
+static int streamable(options_t *opts) {
+    for (const char *type = opts->type; *type != '\0'; type++) {
+        if (memchr(streamTypes, *type, sizeof(streamTypes)) == NULL) return 0;
+    }
+    for (const char *effect = opts->effects; *effect != '\0'; effect++) {
+        if (*effect != Crop_Telemetry) return 0;
+    }
+
+    // Decoding in segments needs the whole pass anyway
+    return opts->jobs <= 1;
+}
+
+/* Images written while a pass is decoded. In realtime mode that's the raw
+ * image as each row comes in, plus previews of the calibrated channel,
+ * temperature and visible images, which the images of the whole pass
+ * replace at the end. With --stream, when every image asked for can be made
+ * from its own rows (see streamable) the streamed images are the final ones
+ * instead, and the pass isn't kept at all. Calibrated images go through apt_telemetry_t,
+ * which holds rows back a frame, and are opened when the first row comes
+ * out of it, once the channels are known.
+ */
+static void startStream(stream_t *stream, options_t *opts, apt_image_t *img, int final) {
+    stream->final = final;
+    if (!final) {
+        char filename[512];
+        sprintf(filename, "%s/%s-r.png", opts->path, img->name);
+        stream->raw = initWriter(filename, APT_IMG_WIDTH, "Unprocessed realtime image", NULL, 1.0f);
+    }
+
+    for (size_t i = 0; i < sizeof(streamTypes); i++) {
+        if (CONTAINS(opts->type, streamTypes[i]) && (final || streamTypes[i] != Raw_Image)) {
+            stream->telemetry = apt_telemetry_create(opts->satnum);
+            if (stream->telemetry == NULL) warning("Could not start calibrating as the pass is decoded");
+            break;
+        }
+    }
+}
+
+// Open the calibrated images of a stream
+static void openStream(stream_t *stream, options_t *opts, apt_image_t *img) {
+    apt_channel_t chA, chB;
+    apt_telemetry_get_channels(stream->telemetry, &chA, &chB);
+
+    for (size_t i = 0; i < sizeof(streamTypes); i++) {
+        char type = streamTypes[i], filename[512], desc[60];
+        if (!CONTAINS(opts->type, type) || (type == Raw_Image && !stream->final)) continue;
+        if ((type == Temperature && chB < 4) || (type == Visible && chA > 2)) continue;
+
+        int width = APT_CH_WIDTH;
+        char *palette = NULL;
+        if (type == Raw_Image) {
+            sprintf(desc, "%s (%s) & %s (%s)", ch.id[chA], ch.name[chA], ch.id[chB], ch.name[chB]);
+            width = CONTAINS(opts->effects, Crop_Telemetry) ? 2 * APT_CH_WIDTH : APT_IMG_WIDTH;
+        } else if (type == Channel_A || type == Channel_B) {
+            apt_channel_t id = (type == Channel_A) ? chA : chB;
+            sprintf(desc, "%s (%s)", ch.id[id], ch.name[id]);
+        } else if (type == Temperature) {
+            strcpy(desc, "Temperature");
+            palette = (char *)apt_TempPalette;
+        } else {
+            strcpy(desc, "Visible");
+        }
+
+        if (stream->final) {
+            imageFilename(filename, opts, img, type);
+        } else {
+            sprintf(filename, "%s/%s-%c.png", opts->path, img->name, type);
+        }
+        stream->images[i] = initWriter(filename, width, desc, palette, opts->gamma);
+    }
+    stream->started = 1;
+}
+
+// Write a calibrated row to the images of a stream
+static void streamCalibrated(stream_t *stream, options_t *opts, apt_image_t *img, const float *row) {
+    if (!stream->started) openStream(stream, opts, img);
+
+    // Temperature is channel B and visible channel A, so they can share a copy
+    float buf[APT_PROW_WIDTH];
+    memcpy(buf, row, sizeof(buf));
+    int temperature = apt_telemetry_calibrate_thermal(stream->telemetry, buf);
+    int visible = apt_telemetry_calibrate_visible(stream->telemetry, buf);
+
+    for (size_t i = 0; i < sizeof(streamTypes); i++) {
+        if (stream->images[i] == NULL) continue;
+
+        if (streamTypes[i] == Raw_Image && CONTAINS(opts->effects, Crop_Telemetry)) {
+            float cropped[2 * APT_CH_WIDTH];
+            memcpy(cropped, &row[APT_CHA_OFFSET], sizeof(float) * APT_CH_WIDTH);
+            memcpy(&cropped[APT_CH_WIDTH], &row[APT_CHB_OFFSET], sizeof(float) * APT_CH_WIDTH);
+            pushRow(stream->images[i], cropped);
+        } else if (streamTypes[i] == Raw_Image) {
+            pushRow(stream->images[i], row);
+        } else if (streamTypes[i] == Channel_A) {
+            pushRow(stream->images[i], &row[APT_CHA_OFFSET]);
+        } else if (streamTypes[i] == Channel_B) {
+            pushRow(stream->images[i], &row[APT_CHB_OFFSET]);
+        } else if (streamTypes[i] == Temperature && temperature) {
+            pushRow(stream->images[i], &buf[APT_CHB_OFFSET]);
+        } else if (streamTypes[i] == Visible && visible) {
+            pushRow(stream->images[i], &buf[APT_CHA_OFFSET]);
+        }
+    }
+    stream->rows++;
+}
+
+static void streamRow(stream_t *stream, options_t *opts, apt_image_t *img, const float *row) {
+    if (stream->raw != NULL) pushRow(stream->raw, row);
+
+    float out[APT_PROW_WIDTH];
+    if (stream->telemetry != NULL && apt_telemetry_push_row(stream->telemetry, row, out)) {
+        streamCalibrated(stream, opts, img, out);
+    }
+}
+
+static void stopStream(stream_t *stream, options_t *opts, apt_image_t *img) {
+    if (stream->telemetry != NULL) {
+        float out[APT_PROW_WIDTH];
+        while (apt_telemetry_flush(stream->telemetry, out)) streamCalibrated(stream, opts, img, out);
+
+        if (stream->final) {
+            apt_channel_t chA, chB;
+            apt_telemetry_get_channels(stream->telemetry, &chA, &chB);
+            printf("Channel A: %s (%s)\n", ch.id[chA], ch.name[chA]);
+            printf("Channel B: %s (%s)\n", ch.id[chB], ch.name[chB]);
+        }
+        apt_telemetry_free(stream->telemetry);
+    }
+
+    if (stream->raw != NULL) closeWriter(stream->raw);
+    for (size_t i = 0; i < sizeof(streamTypes); i++) {
+        if (stream->images[i] != NULL) closeWriter(stream->images[i]);
+    }
+}
+
+// Decode the whole audio file on this thread (plus two more with --pipeline)
+static void decodeSerial(apt_decoder_t *decoder, options_t *opts, apt_image_t *img, stream_t *stream) {
+    // Read straight from the file, or from the demodulator thread
+    apt_getsamples_t source = getsamples;
+    void *context = NULL;
+#ifdef APT_HAVE_THREADS
+    pipeline_t pipeline;
+    if (opts->pipeline) {
+        if (startPipeline(&pipeline, decoder, opts)) {
+            source = ringGetsamples;
+            context = &pipeline.amplitude;
+        } else {
+            warning("Could not start decoding threads, using a single thread");
+            opts->pipeline = 0;
+        }
+    }
+#else
+    if (opts->pipeline) warning("Not built with thread support, using a single thread");
+#endif
+
+    // Build image, a batch of rows at a time (one at a time in realtime so each is shown straight away).
+    // Batches stay within a chunk, since rows are only contiguous within one.
+    // Rows that only went to the final images of a stream aren't kept, the image then just holds a batch
+    int batch = opts->realtime ? 1 : DECODE_BATCH;
+    int dropped = 0;
+    for (img->nrow = 0; !opts->realtime || img->nrow < APT_MAX_HEIGHT;) {
+        if (!apt_image_reserve(img, img->nrow + 1)) {
+            warning("Could not allocate more rows, stopping");
+            break;
+        }
+        int count = MIN(batch, APT_IMAGE_CHUNK - img->nrow % APT_IMAGE_CHUNK);
+
+        // Write into memory and stop when there are no more samples to read
+        int y = dropped + img->nrow;
+        int n = apt_decoder_getpixelrows(decoder, img->prow[img->nrow], APT_IMAGE_STRIDE, count, y, &img->zenith, NULL, source,
+                                         context);
+        for (int i = 0; i < n; i++) {
+            if (stream != NULL) streamRow(stream, opts, img, img->prow[img->nrow + i]);
+        }
+        img->nrow += n;
+
+        fprintf(stderr, "Row: %d\r", dropped + img->nrow);
+        fflush(stderr);
+        if (stream != NULL && stream->final) {
+            dropped += img->nrow;
+            img->nrow = 0;
+        }
+        if (n < count) break;
+    }
+
+#ifdef APT_HAVE_THREADS
+    if (opts->pipeline) stopPipeline(&pipeline);
+#endif
+}
+
 float *samplebuf;
-static int initsnd(char *filename) {
+static apt_decoder_t *initsnd(char *filename, options_t *opts) {
     SF_INFO infwav;
-    int res;
 
     // Open audio file
     infwav.format = 0;
     audioFile = sf_open(filename, SFM_READ, &infwav);
     if (audioFile == NULL) {
         error_noexit("Could not file");
-        return 0;
+        return NULL;
     }
 
-    res = apt_init(infwav.samplerate);
+    apt_decoder_t *decoder = apt_decoder_create(infwav.samplerate);
     printf("Input file: %s\n", filename);
-    if (res < 0) {
-        error_noexit("Input sample rate too low");
-        return 0;
-    } else if (res > 0) {
-        error_noexit("Input sample rate too high");
-        return 0;
+    if (decoder == NULL) {
+        error_noexit("Unsupported input sample rate");
+        sf_close(audioFile);
+        return NULL;
     }
     printf("Input sample rate: %d\n", infwav.samplerate);
+    samplerate = infwav.samplerate;
+    frames = infwav.frames;
+    apt_decoder_set_fast_pll(decoder, opts->fast_pll);
 
     channels = infwav.channels;
     samplebuf = (float *)malloc(sizeof(float) * 32768 * channels);
 
-    return 1;
+    return decoder;
 }
 
 // Read samples from the audio file
 int getsamples(void *context, float *samples, int nb) {
     (void)context;
-    if (channels == 1) {
-        return (int)sf_read_float(audioFile, samples, nb);
-    } else if (channels == 2) {
+    return readSamples(audioFile, channels, samplebuf, samples, nb);
+}
+
+// Read samples from the first channel of a file, buf must fit nb frames of all channels
+static int readSamples(SNDFILE *file, int nchannels, float *buf, float *samples, int nb) {
+    if (nchannels == 1) {
+        return (int)sf_read_float(file, samples, nb);
+    } else if (nchannels == 2) {
         // Stereo channels are interleaved
-        int samplesRead = (int)sf_read_float(audioFile, samplebuf, nb * channels);
+        int samplesRead = (int)sf_read_float(file, buf, nb * nchannels);
         for (int i = 0; i < nb; i++) {
-            samples[i] = samplebuf[i * channels];
+            samples[i] = buf[i * nchannels];
         }
-        return samplesRead / channels;
+        return samplesRead / nchannels;
     } else {
         printf("Only mono and stereo input files are supported\n");
         exit(1);
     }
 }
+
+#ifdef APT_HAVE_THREADS
+// Read the audio file into the sample ring
+static int readerThread(void *arg) {
+    pipeline_t *pipeline = (pipeline_t *)arg;
+    float buf[PIPELINE_CHUNK];
+
+    int n;
+    while ((n = getsamples(NULL, buf, PIPELINE_CHUNK)) > 0) {
+        if (ring_write_all(&pipeline->samples, buf, n) < (size_t)n) break;
+    }
+    ring_close(&pipeline->samples);
+
+    return 0;
+}
+
+// Demodulate the sample ring into the amplitude ring
+static int demodThread(void *arg) {
+    pipeline_t *pipeline = (pipeline_t *)arg;
+    float buf[PIPELINE_CHUNK];
+
+    int n;
+    while ((n = apt_decoder_demodulate(pipeline->demodulator, buf, PIPELINE_CHUNK, ringGetsamples, &pipeline->samples)) > 0) {
+        if (ring_write_all(&pipeline->amplitude, buf, n) < (size_t)n) break;
+    }
+    ring_close(&pipeline->amplitude);
+
+    return 0;
+}
+
+static int ringGetsamples(void *context, float *samples, int nb) { return (int)ring_read_all((ring_t *)context, samples, nb); }
+
+/* Split decoding over three threads: the reader thread fills the sample ring
+ * from the audio file, the demodulator thread runs the front end of a second
+ * decoder on those samples and the calling thread assembles rows from the
+ * amplitude ring, so the total time is close to that of the slowest stage.
+ */
+static int startPipeline(pipeline_t *pipeline, apt_decoder_t *decoder, options_t *opts) {
+    pipeline->demodulator = apt_decoder_create(samplerate);
+    if (pipeline->demodulator == NULL) return 0;
+    apt_decoder_set_fast_pll(pipeline->demodulator, opts->fast_pll);
+
+    if (!ring_init(&pipeline->samples, PIPELINE_RING_SIZE)) {
+        apt_decoder_free(pipeline->demodulator);
+        return 0;
+    }
+    if (!ring_init(&pipeline->amplitude, PIPELINE_RING_SIZE)) {
+        ring_free(&pipeline->samples);
+        apt_decoder_free(pipeline->demodulator);
+        return 0;
+    }
+
+    int started = 0;
+    if (thrd_create(&pipeline->reader_thread, readerThread, pipeline) == thrd_success) {
+        if (thrd_create(&pipeline->demod_thread, demodThread, pipeline) == thrd_success) {
+            started = 1;
+        } else {
+            ring_close(&pipeline->samples);
+            thrd_join(pipeline->reader_thread, NULL);
+        }
+    }
+    if (!started) {
+        ring_free(&pipeline->samples);
+        ring_free(&pipeline->amplitude);
+        apt_decoder_free(pipeline->demodulator);
+        return 0;
+    }
+
+    apt_decoder_set_demodulated_input(decoder, 1);
+    return 1;
+}
+
+static void stopPipeline(pipeline_t *pipeline) {
+    // Closing both rings stops the threads early, in case not all rows were read
+    ring_close(&pipeline->amplitude);
+    ring_close(&pipeline->samples);
+    thrd_join(pipeline->demod_thread, NULL);
+    thrd_join(pipeline->reader_thread, NULL);
+
+    ring_free(&pipeline->samples);
+    ring_free(&pipeline->amplitude);
+    apt_decoder_free(pipeline->demodulator);
+}
+
+// Read samples from a segment, stopping at its end
+static int segmentGetsamples(void *context, float *samples, int nb) {
+    segment_t *segment = (segment_t *)context;
+    if (nb > segment->remaining) nb = (int)segment->remaining;
+
+    int n = readSamples(segment->file, segment->channels, segment->buf, samples, nb);
+    segment->remaining -= n;
+    return n;
+}
+
+static int decodeSegment(void *arg) {
+    segment_t *segment = (segment_t *)arg;
+    apt_decoder_t *decoder = apt_decoder_create(samplerate);
+    if (decoder == NULL) return 0;
+    apt_decoder_set_fast_pll(decoder, segment->opts->fast_pll);
+
+    int zenith = 0;
+    segment->nrow = apt_decoder_getpixelrows(decoder, segment->rows, APT_PROW_WIDTH, segment->maxrow, 0, &zenith, segment->info,
+                                             segmentGetsamples, segment);
+
+    apt_decoder_free(decoder);
+    return 1;
+}
+
+static void freeSegment(segment_t *segment) {
+    if (segment->file != NULL) sf_close(segment->file);
+    free(segment->buf);
+    free(segment->rows);
+    free(segment->info);
+}
+
+/* Split the file into one segment per job and decode each with its own
+ * decoder on its own thread. Every segment starts SEGMENT_WARMUP seconds
+ * early, so it is locked by the time its own part begins. The rows are then
+ * stitched back together by time: a segment contributes the rows that start
+ * before the next segment does, and rows that start within half a row of the
+ * last one kept are the same row seen by two decoders, so are dropped.
+ */
+static int decodeParallel(char *filename, options_t *opts, apt_image_t *img) {
+    int jobs = opts->jobs;
+    segment_t *segments = (segment_t *)calloc(jobs, sizeof(segment_t));
+    thrd_t *threads = (thrd_t *)calloc(jobs, sizeof(thrd_t));
+    int *started = (int *)calloc(jobs, sizeof(int));
+    if (segments == NULL || threads == NULL || started == NULL) {
+        free(segments);
+        free(threads);
+        free(started);
+        return 0;
+    }
+
+    int ok = 1;
+    for (int i = 0; i < jobs && ok; i++) {
+        segment_t *segment = &segments[i];
+        sf_count_t begin = frames * i / jobs;
+        sf_count_t end = (i == jobs - 1) ? frames : frames * (i + 1) / jobs + (sf_count_t)(SEGMENT_MARGIN * samplerate);
+        segment->start = MAX(begin - (sf_count_t)(SEGMENT_WARMUP * samplerate), 0);
+        segment->remaining = MIN(end, frames) - segment->start;
+        segment->opts = opts;
+
+        // Each thread reads through its own handle
+        SF_INFO info;
+        info.format = 0;
+        segment->file = sf_open(filename, SFM_READ, &info);
+        if (segment->file == NULL || sf_seek(segment->file, segment->start, SEEK_SET) < 0) {
+            ok = 0;
+            break;
+        }
+        segment->channels = info.channels;
+
+        segment->maxrow = (int)(segment->remaining * 2 / samplerate) + 4;
+        segment->buf = (float *)malloc(sizeof(float) * 32768 * info.channels);
+        segment->rows = (float *)malloc(sizeof(float) * APT_PROW_WIDTH * segment->maxrow);
+        segment->info = (apt_row_info_t *)malloc(sizeof(apt_row_info_t) * segment->maxrow);
+        if (segment->buf == NULL || segment->rows == NULL || segment->info == NULL) {
+            ok = 0;
+            break;
+        }
+    }
+
+    // Segments that can't get a thread are decoded on this one
+    for (int i = 0; i < jobs && ok; i++) {
+        started[i] = (thrd_create(&threads[i], decodeSegment, &segments[i]) == thrd_success);
+    }
+    // Every thread that was started is joined, even after a failure, as the segments are freed below
+    for (int i = 0; i < jobs; i++) {
+        if (started[i]) {
+            int res;
+            thrd_join(threads[i], &res);
+            if (!res) ok = 0;
+        } else if (ok && !decodeSegment(&segments[i])) {
+            ok = 0;
+        }
+    }
+
+    // Stitch, closest approach is where the drift of the sync marker is smallest (same as apt_decoder_getpixelrow)
+    img->nrow = 0;
+    double last = -INFINITY;
+    float minDoppler = 1000000000, previous = 0;
+    int full = 0;
+    for (int i = 0; i < jobs; i++) {
+        segment_t *segment = &segments[i];
+        double next = (i == jobs - 1) ? INFINITY : (double)(frames * (i + 1) / jobs) / samplerate;
+
+        // Like the serial decode, stop at the first row that can't be allocated rather than leave a gap in time
+        for (int j = 0; j < segment->nrow && ok && !full; j++) {
+            double time = (double)segment->start / samplerate + segment->info[j].time;
+            if (time < last + 0.25 || time >= next) continue;
+            if (!apt_image_reserve(img, img->nrow + 1)) {
+                warning("Could not allocate more rows, stopping");
+                full = 1;
+                break;
+            }
+
+            float val = fabsf(segment->info[j].line_rate) * 0.25f + previous * 0.75f;
+            if (val < minDoppler && img->nrow > 10) {
+                minDoppler = val;
+                img->zenith = img->nrow;
+            }
+            previous = fabsf(segment->info[j].line_rate);
+
+            memcpy(img->prow[img->nrow++], &segment->rows[j * APT_PROW_WIDTH], sizeof(float) * APT_PROW_WIDTH);
+            last = time;
+        }
+        freeSegment(segment);
+    }
+
+    free(segments);
+    free(threads);
+    free(started);
+    if (!ok) warning("Could not decode in parallel, using a single thread");
+    return ok;
+}
+#endif
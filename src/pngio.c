@@ -25,10 +25,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
+#ifdef APT_HAVE_THREADS
+#include <threads.h>
+#endif
 
 #include "util.h"
 
-int readRawImage(char *filename, float **prow, int *nrow) {
+int readRawImage(char *filename, apt_image_t *img) {
     FILE *fp = fopen(filename, "rb");
     printf("%s", filename);
     if (!fp) {
@@ -81,12 +85,16 @@ int readRawImage(char *filename, float **prow, int *nrow) {
     png_destroy_read_struct(&png, &info, NULL);
 
     // Put into prow
-    *nrow = height;
-    for (int y = 0; y < height; y++) {
-        prow[y] = (float *)malloc(sizeof(float) * width);
-
-        for (int x = 0; x < width; x++) prow[y][x] = (float)PNGrows[y][x];
+    if (!apt_image_alloc(img, height)) {
+        error_noexit("Could not allocate the image");
+        return 0;
     }
+    img->nrow = height;
+    for (int y = 0; y < img->nrow; y++) {
+        for (int x = 0; x < width; x++) img->prow[y][x] = (float)PNGrows[y][x];
+    }
+    for (int y = 0; y < height; y++) free(PNGrows[y]);
+    free(PNGrows);
 
     return 1;
 }
@@ -106,6 +114,7 @@ int readPalette(char *filename, apt_rgb_t **pixels) {
     }
     png_infop info = png_create_info_struct(png);
     if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
         fclose(fp);
         return 0;
     }
@@ -119,14 +128,18 @@ int readPalette(char *filename, apt_rgb_t **pixels) {
     png_byte bit_depth = png_get_bit_depth(png, info);
 
     // Check the image
-    if (width != 256 && height != 256) {
-        error_noexit("Palette must be 256x256");
-        return 0;
+    const char *problem = NULL;
+    if (width != 256 || height != 256) {
+        problem = "Palette must be 256x256";
     } else if (bit_depth != 8) {
-        error_noexit("Palette must be 8 bit color");
-        return 0;
+        problem = "Palette must be 8 bit color";
     } else if (color_type != PNG_COLOR_TYPE_RGB) {
-        error_noexit("Palette must be RGB");
+        problem = "Palette must be RGB";
+    }
+    if (problem != NULL) {
+        error_noexit(problem);
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(fp);
         return 0;
     }
 
@@ -149,52 +162,60 @@ int readPalette(char *filename, apt_rgb_t **pixels) {
         for (int x = 0; x < width; x++)
             pixels[y][x] = (apt_rgb_t){PNGrows[y][x * 3], PNGrows[y][x * 3 + 1], PNGrows[y][x * 3 + 2]};
     }
+    for (int y = 0; y < height; y++) free(PNGrows[y]);
+    free(PNGrows);
 
     return 1;
 }
 
-void prow2crow(float **prow, int nrow, char *palette, apt_rgb_t **crow) {
-    for (int y = 0; y < nrow; y++) {
+void prow2crow(apt_image_t *img, char *palette, apt_rgb_t **crow) {
+    float buf[APT_PROW_WIDTH];
+    for (int y = 0; y < img->nrow; y++) {
+        const float *row = apt_image_load_row(img, y, buf);
         crow[y] = (apt_rgb_t *)malloc(sizeof(apt_rgb_t) * APT_IMG_WIDTH);
 
         for (int x = 0; x < APT_IMG_WIDTH; x++) {
             if (palette == NULL)
-                crow[y][x].r = crow[y][x].g = crow[y][x].b = prow[y][x];
+                crow[y][x].r = crow[y][x].g = crow[y][x].b = row[x];
             else
-                crow[y][x] = apt_applyPalette(palette, prow[y][x]);
+                crow[y][x] = apt_applyPalette(palette, row[x]);
         }
     }
 }
 
-int applyUserPalette(float **prow, int nrow, char *filename, apt_rgb_t **crow) {
+int applyUserPalette(apt_image_t *img, char *filename, apt_rgb_t **crow) {
     apt_rgb_t *pal_row[256];
     if (!readPalette(filename, pal_row)) {
         error_noexit("Could not read palette");
         return 0;
     }
 
-    for (int y = 0; y < nrow; y++) {
+    float buf[APT_PROW_WIDTH];
+    for (int y = 0; y < img->nrow; y++) {
+        const float *row = apt_image_load_row(img, y, buf);
         for (int x = 0; x < APT_CH_WIDTH; x++) {
-            int cha = CLIP(prow[y][x + APT_CHA_OFFSET], 0, 255);
-            int chb = CLIP(prow[y][x + APT_CHB_OFFSET], 0, 255);
+            int cha = CLIP(row[x + APT_CHA_OFFSET], 0, 255);
+            int chb = CLIP(row[x + APT_CHB_OFFSET], 0, 255);
             crow[y][x + APT_CHA_OFFSET] = pal_row[chb][cha];
         }
     }
 
+    // Palettes are read for every palette image, which can be several per run
+    for (int y = 0; y < 256; y++) free(pal_row[y]);
     return 1;
 }
 
-int ImageOut(options_t *opts, apt_image_t *img, int offset, int width, char *desc, char chid, char *palette) {
-    char outName[512];
+void imageFilename(char *filename, options_t *opts, apt_image_t *img, char chid) {
     if (opts->filename == NULL || opts->filename[0] == '\0') {
-        sprintf(outName, "%s/%s-%c.png", opts->path, img->name, chid);
+        sprintf(filename, "%s/%s-%c.png", opts->path, img->name, chid);
     } else {
-        sprintf(outName, "%s/%s", opts->path, opts->filename);
+        sprintf(filename, "%s/%s", opts->path, opts->filename);
     }
+}
 
-    png_text meta[] = {{PNG_TEXT_COMPRESSION_NONE, "Software", VERSION, sizeof(VERSION)},
-                       {PNG_TEXT_COMPRESSION_NONE, "Channel", desc, sizeof(desc)},
-                       {PNG_TEXT_COMPRESSION_NONE, "Description", "NOAA satellite image", 20}};
+int ImageOut(options_t *opts, apt_image_t *img, int offset, int width, char *desc, char chid, char *palette, int jobs) {
+    char outName[512];
+    imageFilename(outName, opts, img, chid);
 
     // Parse image type
     int greyscale = 1;
@@ -246,166 +267,450 @@ int ImageOut(options_t *opts, apt_image_t *img, int offset, int width, char *des
         }
     }
 
-    FILE *pngfile;
-
-    // Create writer
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr) {
-        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-        error_noexit("Could not create a PNG writer");
+    // 8 bit greyscale or RGB pixels
+    int bpp = greyscale ? 1 : 3;
+    png_byte *pixels = (png_byte *)malloc((size_t)img->nrow * width * bpp);
+    if (pixels == NULL) {
+        error_noexit("Could not allocate the image");
         return 0;
     }
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-        error_noexit("Could not create a PNG writer");
-        return 0;
-    }
-
-    if (greyscale) {
-        // Greyscale image
-        png_set_IHDR(png_ptr, info_ptr, width, img->nrow, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
-                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    } else {
-        // 8 bit RGB image
-        png_set_IHDR(png_ptr, info_ptr, width, img->nrow, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                     PNG_FILTER_TYPE_DEFAULT);
-    }
-
-    png_set_text(png_ptr, info_ptr, meta, 3);
-    png_set_pHYs(png_ptr, info_ptr, 3636, 3636, PNG_RESOLUTION_METER);
-
-    // Init I/O
-    pngfile = fopen(outName, "wb");
-    if (!pngfile) {
-        error_noexit("Could not open PNG for writing");
-        return 1;
-    }
-    png_init_io(png_ptr, pngfile);
-    png_write_info(png_ptr, info_ptr);
 
     // Move prow into crow, crow ~ color rows, if required
-    apt_rgb_t *crow[APT_MAX_HEIGHT];
+    apt_rgb_t **crow = NULL;
     if (!greyscale) {
-        prow2crow(img->prow, img->nrow, palette, crow);
+        crow = (apt_rgb_t **)malloc(sizeof(apt_rgb_t *) * img->nrow);
+        if (crow == NULL) {
+            error_noexit("Could not allocate color rows");
+            free(pixels);
+            return 0;
+        }
+        prow2crow(img, palette, crow);
     }
 
     // Apply a user provided color palette
     if (chid == Palleted) {
-        applyUserPalette(img->prow, img->nrow, opts->palette, crow);
+        applyUserPalette(img, opts->palette, crow);
     }
 
     // Precipitation overlay
     if (CONTAINS(opts->effects, Precipitation_Overlay)) {
+        float buf[APT_PROW_WIDTH];
         for (int y = 0; y < img->nrow; y++) {
+            const float *row = apt_image_load_row(img, y, buf);
             for (int x = 0; x < APT_CH_WIDTH; x++) {
-                if (img->prow[y][x + APT_CHB_OFFSET] >= 198)
+                if (row[x + APT_CHB_OFFSET] >= 198)
                     crow[y][x + APT_CHB_OFFSET] = crow[y][x + APT_CHA_OFFSET] =
-                        apt_applyPalette(apt_PrecipPalette, img->prow[y][x + APT_CHB_OFFSET] - 198);
+                        apt_applyPalette(apt_PrecipPalette, row[x + APT_CHB_OFFSET] - 198);
             }
         }
     }
 
-    printf("Writing %s", outName);
-
 // Float power macro (for gamma adjustment)
 #define POWF(a, b) (b == 1.0 ? a : exp(b * log(a)))
     float a = POWF(255, opts->gamma) / 255;
 
     // Build image
     for (int y = 0; y < img->nrow; y++) {
-        png_color pix[APT_IMG_WIDTH];  // Color
-        png_byte mpix[APT_IMG_WIDTH];  // Mono
+        png_byte *pix = &pixels[(size_t)y * width * bpp];
+        float buf[APT_PROW_WIDTH];
+        const float *row = greyscale ? apt_image_load_row(img, y, buf) : NULL;
 
         int skip = 0;
         for (int x = 0; x < width; x++) {
             if (crop_telemetry && x == APT_CH_WIDTH) skip += APT_TELE_WIDTH + APT_SYNC_WIDTH + APT_SPC_WIDTH;
 
             if (greyscale) {
-                mpix[x] = POWF(img->prow[y][x + skip + offset], opts->gamma) / a;
+                pix[x] = POWF(row[x + skip + offset], opts->gamma) / a;
             } else {
-                pix[x] = (png_color){POWF(crow[y][x + skip + offset].r, opts->gamma) / a,
-                                     POWF(crow[y][x + skip + offset].g, opts->gamma) / a,
-                                     POWF(crow[y][x + skip + offset].b, opts->gamma) / a};
+                pix[x * 3 + 0] = POWF(crow[y][x + skip + offset].r, opts->gamma) / a;
+                pix[x * 3 + 1] = POWF(crow[y][x + skip + offset].g, opts->gamma) / a;
+                pix[x * 3 + 2] = POWF(crow[y][x + skip + offset].b, opts->gamma) / a;
             }
         }
-
-        if (greyscale) {
-            png_write_row(png_ptr, (png_bytep)mpix);
-        } else {
-            png_write_row(png_ptr, (png_bytep)pix);
-        }
     }
 
     // Tidy up
-    png_write_end(png_ptr, info_ptr);
-    fclose(pngfile);
-    printf("\nDone\n");
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+    if (crow != NULL) {
+        for (int y = 0; y < img->nrow; y++) free(crow[y]);
+        free(crow);
+    }
 
-    return 1;
+    int ok = writeImage(outName, width, img->nrow, bpp, pixels, desc, jobs);
+    free(pixels);
+    return ok;
+}
+
+/* PNG written a row at a time, without keeping the image. libpng needs the
+ * height before the first row, which isn't known until a pass has been
+ * decoded, so the file is put together here instead: rows are filtered
+ * (picking the filter with the smallest sum of differences, like libpng
+ * does) and deflated into IDAT chunks as they come in, and the height in
+ * the IHDR chunk is filled in once the writer is closed.
+ */
+
+// Bytes of compressed rows per IDAT chunk
+#define IDAT_SIZE 65536
+
+struct writer {
+    FILE *pngfile;
+    char *palette;  // Colour rows with this palette, or greyscale if NULL
+    float gamma;
+    int width;      // Pixels per row
+    int bpp;        // Bytes per pixel
+    int height;     // Rows written so far
+    z_stream zs;
+    png_byte *buffer;
+    png_byte *row, *prev;    // This row and the one before
+    png_byte *best, *trial;  // Filtered rows, with the filter type in front
+    png_byte idat[IDAT_SIZE];
+};
+
+static void put32(png_byte *dst, uint32_t value) {
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
 }
 
-// TODO: clean up everthing below this comment
-png_structp rt_png_ptr;
-png_infop rt_info_ptr;
-FILE *rt_pngfile;
+static void writeChunk(FILE *file, const char *type, const png_byte *data, uint32_t len) {
+    png_byte head[8], crc[4];
+    put32(head, len);
+    memcpy(&head[4], type, 4);
+    uLong sum = crc32(0, &head[4], 4);
+    if (len > 0) sum = crc32(sum, data, len);
+    put32(crc, sum);
+
+    fwrite(head, 1, sizeof(head), file);
+    if (len > 0) fwrite(data, 1, len, file);
+    fwrite(crc, 1, sizeof(crc), file);
+}
+
+static void writeIHDR(FILE *file, int width, int height, int bpp) {
+    png_byte ihdr[13] = {0};
+    put32(&ihdr[0], width);
+    put32(&ihdr[4], height);
+    ihdr[8] = 8;
+    ihdr[9] = (bpp == 1) ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB;
+    writeChunk(file, "IHDR", ihdr, sizeof(ihdr));
+}
 
-int initWriter(options_t *opts, apt_image_t *img, int width, int height, char *desc, char *chid) {
-    char outName[384];
-    sprintf(outName, "%s/%s-%s.png", opts->path, img->name, chid);
+static void writeText(FILE *file, const char *keyword, const char *text) {
+    png_byte chunk[256];
+    size_t klen = strlen(keyword) + 1, tlen = MIN(strlen(text), sizeof(chunk) - klen);
+    memcpy(chunk, keyword, klen);
+    memcpy(&chunk[klen], text, tlen);
+    writeChunk(file, "tEXt", chunk, klen + tlen);
+}
 
-    png_text meta[] = {{PNG_TEXT_COMPRESSION_NONE, "Software", VERSION, sizeof(VERSION)},
-                       {PNG_TEXT_COMPRESSION_NONE, "Channel", desc, sizeof(desc)},
-                       {PNG_TEXT_COMPRESSION_NONE, "Description", "NOAA satellite image", 20}};
+// Everything up to the image data
+static void writeHeader(FILE *file, int width, int height, int bpp, const char *desc) {
+    static const png_byte signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    fwrite(signature, 1, sizeof(signature), file);
+    writeIHDR(file, width, height, bpp);
 
-    // Create writer
-    rt_png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!rt_png_ptr) {
-        png_destroy_write_struct(&rt_png_ptr, (png_infopp)NULL);
+    writeText(file, "Software", VERSION);
+    writeText(file, "Channel", desc);
+    writeText(file, "Description", "NOAA satellite image");
+
+    // Channel = 25cm wide
+    png_byte phys[9] = {0};
+    put32(&phys[0], 3636);
+    put32(&phys[4], 3636);
+    phys[8] = PNG_RESOLUTION_METER;
+    writeChunk(file, "pHYs", phys, sizeof(phys));
+}
+
+// Deflate len bytes into IDAT chunks, finishing the stream if flush is Z_FINISH
+static void deflateRows(writer_t *writer, png_byte *data, int len, int flush) {
+    z_stream *zs = &writer->zs;
+    zs->next_in = data;
+    zs->avail_in = len;
+
+    for (;;) {
+        int status = deflate(zs, flush);
+        if (zs->avail_out == 0) {
+            writeChunk(writer->pngfile, "IDAT", writer->idat, IDAT_SIZE);
+            zs->next_out = writer->idat;
+            zs->avail_out = IDAT_SIZE;
+            continue;
+        }
+        if ((flush == Z_FINISH) ? (status == Z_STREAM_END || status == Z_STREAM_ERROR) : (zs->avail_in == 0)) break;
+    }
+
+    if (flush == Z_FINISH && zs->avail_out < IDAT_SIZE) {
+        writeChunk(writer->pngfile, "IDAT", writer->idat, IDAT_SIZE - zs->avail_out);
+    }
+}
+
+// Filter row with filter type, returns the sum of the differences
+static long filterRow(png_byte *dst, const png_byte *row, const png_byte *prev, int len, int bpp, int type) {
+    long sum = 0;
+    dst[0] = type;
+    for (int i = 0; i < len; i++) {
+        int a = (i >= bpp) ? row[i - bpp] : 0, b = prev[i], c = (i >= bpp) ? prev[i - bpp] : 0;
+        int predict = 0;
+        if (type == 1) {
+            predict = a;
+        } else if (type == 2) {
+            predict = b;
+        } else if (type == 3) {
+            predict = (a + b) / 2;
+        } else if (type == 4) {
+            int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            predict = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+        }
+
+        dst[i + 1] = (png_byte)(row[i] - predict);
+        sum += (dst[i + 1] < 128) ? dst[i + 1] : 256 - dst[i + 1];
+    }
+    return sum;
+}
+
+// Filter row into dst with whichever filter leaves the smallest differences, trial is len + 1 bytes of scratch
+static void filterBest(png_byte *dst, png_byte *trial, const png_byte *row, const png_byte *prev, int len, int bpp) {
+    long best = -1;
+    for (int type = 0; type < 5; type++) {
+        long sum = filterRow(trial, row, prev, len, bpp, type);
+        if (best == -1 || sum < best) {
+            memcpy(dst, trial, len + 1);
+            best = sum;
+        }
+    }
+}
+
+writer_t *initWriter(char *filename, int width, char *desc, char *palette, float gamma) {
+    writer_t *writer = (writer_t *)calloc(1, sizeof(writer_t));
+    if (writer == NULL) {
         error_noexit("Could not create a PNG writer");
-        return 0;
+        return NULL;
     }
-    rt_info_ptr = png_create_info_struct(rt_png_ptr);
-    if (!rt_info_ptr) {
-        png_destroy_write_struct(&rt_png_ptr, (png_infopp)NULL);
+    writer->palette = palette;
+    writer->gamma = gamma;
+    writer->width = width;
+    writer->bpp = (palette == NULL) ? 1 : 3;
+
+    int len = width * writer->bpp;
+    writer->buffer = (png_byte *)calloc(2 * len + 2 * (len + 1), 1);
+    if (writer->buffer == NULL || deflateInit(&writer->zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
         error_noexit("Could not create a PNG writer");
-        return 0;
+        free(writer->buffer);
+        free(writer);
+        return NULL;
+    }
+    writer->row = writer->buffer;
+    writer->prev = &writer->row[len];
+    writer->best = &writer->prev[len];
+    writer->trial = &writer->best[len + 1];
+    writer->zs.next_out = writer->idat;
+    writer->zs.avail_out = IDAT_SIZE;
+
+    writer->pngfile = fopen(filename, "wb");
+    if (!writer->pngfile) {
+        error_noexit("Could not open PNG for writing");
+        deflateEnd(&writer->zs);
+        free(writer->buffer);
+        free(writer);
+        return NULL;
     }
+    printf("Writing %s\n", filename);
 
-    // Greyscale image
-    png_set_IHDR(rt_png_ptr, rt_info_ptr, width, height, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                 PNG_FILTER_TYPE_DEFAULT);
+    // Header, with the height left at 0 until the writer is closed
+    writeHeader(writer->pngfile, width, 0, writer->bpp, desc);
+    return writer;
+}
 
-    png_set_text(rt_png_ptr, rt_info_ptr, meta, 3);
+void pushRow(writer_t *writer, const float *row) {
+    float a = POWF(255, writer->gamma) / 255;
+    for (int x = 0; x < writer->width; x++) {
+        if (writer->palette == NULL) {
+            writer->row[x] = POWF(row[x], writer->gamma) / a;
+        } else {
+            apt_rgb_t color = apt_applyPalette(writer->palette, row[x]);
+            writer->row[x * 3 + 0] = POWF(color.r, writer->gamma) / a;
+            writer->row[x * 3 + 1] = POWF(color.g, writer->gamma) / a;
+            writer->row[x * 3 + 2] = POWF(color.b, writer->gamma) / a;
+        }
+    }
 
-    // Channel = 25cm wide
-    png_set_pHYs(rt_png_ptr, rt_info_ptr, 3636, 3636, PNG_RESOLUTION_METER);
+    int len = writer->width * writer->bpp;
+    filterBest(writer->best, writer->trial, writer->row, writer->prev, len, writer->bpp);
+    deflateRows(writer, writer->best, len + 1, Z_NO_FLUSH);
 
-    // Init I/O
-    rt_pngfile = fopen(outName, "wb");
-    if (!rt_pngfile) {
-        error_noexit("Could not open PNG for writing");
+    png_byte *swap = writer->prev;
+    writer->prev = writer->row;
+    writer->row = swap;
+    writer->height++;
+}
+
+int closeWriter(writer_t *writer) {
+    deflateRows(writer, NULL, 0, Z_FINISH);
+    deflateEnd(&writer->zs);
+    writeChunk(writer->pngfile, "IEND", NULL, 0);
+
+    // Now the height is known
+    int ok = fseek(writer->pngfile, 8, SEEK_SET) == 0;
+    if (ok) writeIHDR(writer->pngfile, writer->width, writer->height, writer->bpp);
+    ok = ok && !ferror(writer->pngfile);
+    ok = (fclose(writer->pngfile) == 0) && ok;
+    if (!ok) error_noexit("Could not write PNG");
+
+    free(writer->buffer);
+    free(writer);
+    return ok;
+}
+
+/* Whole images are deflated in bands of rows, a thread each, the way pigz
+ * does it: every band is a raw deflate stream of its own, primed with the
+ * 32KB of filtered rows before it as a dictionary (which the band filters
+ * itself, so the bands don't wait on each other) and ended with a sync
+ * flush so the next one starts on a byte boundary. The last band finishes
+ * the stream. Together, between a zlib header and the Adler-32 of the whole
+ * lot (combined from those of each band), they are one zlib stream that any
+ * PNG reader can decode, barely larger than deflating it all in one go.
+ */
+
+// Filtered bytes a band should have at least, so small images aren't split for nothing
+#define BAND_MIN 131072
+// Deflate window, and so the most a band can look back
+#define WINDOW_SIZE 32768
+
+// A band of rows of an image, see writeImage
+typedef struct {
+    const png_byte *pixels;  // The whole image
+    int width, bpp;
+    int begin, end;  // Rows of the band
+    int last;        // Finishes the stream
+    png_byte *out;   // Deflated band, with room for the zlib header and trailer either side
+    size_t start;    // Where the deflated band begins in out, after the header if it's the first band
+    size_t outlen;   // Bytes in out
+    uLong adler;     // Of the filtered rows of the band
+    uLong len;
+    int ok;
+} band_t;
+
+static int deflateBand(void *arg) {
+    band_t *band = (band_t *)arg;
+    int len = band->width * band->bpp;
+    band->ok = 0;
+
+    // Filter the rows the dictionary comes from too
+    int first = MAX(band->begin - (WINDOW_SIZE + len) / (len + 1), 0);
+    size_t dict = (size_t)(band->begin - first) * (len + 1);
+    band->len = (uLong)(band->end - band->begin) * (len + 1);
+    png_byte *filtered = (png_byte *)malloc(dict + band->len + len + 1);
+    png_byte *zero = (png_byte *)calloc(len, 1);
+    if (filtered == NULL || zero == NULL) {
+        free(filtered);
+        free(zero);
         return 0;
     }
-    png_init_io(rt_png_ptr, rt_pngfile);
-    png_write_info(rt_png_ptr, rt_info_ptr);
+    png_byte *trial = &filtered[dict + band->len];
+    for (int y = first; y < band->end; y++) {
+        const png_byte *prev = (y == 0) ? zero : &band->pixels[(size_t)(y - 1) * len];
+        filterBest(&filtered[(size_t)(y - first) * (len + 1)], trial, &band->pixels[(size_t)y * len], prev, len, band->bpp);
+    }
+    free(zero);
+    band->adler = adler32(adler32(0, NULL, 0), &filtered[dict], band->len);
 
-    // Turn off compression
-    png_set_compression_level(rt_png_ptr, 0);
+    z_stream zs = {0};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(filtered);
+        return 0;
+    }
+    size_t bound = deflateBound(&zs, band->len) + 16;
+    band->out = (png_byte *)malloc(band->start + bound + 4);
+    if (band->out != NULL) {
+        if (dict > WINDOW_SIZE) dict = WINDOW_SIZE;
+        if (dict > 0) deflateSetDictionary(&zs, &filtered[(size_t)(band->begin - first) * (len + 1) - dict], dict);
+
+        zs.next_in = &filtered[(size_t)(band->begin - first) * (len + 1)];
+        zs.avail_in = band->len;
+        zs.next_out = &band->out[band->start];
+        zs.avail_out = bound;
+        int status = deflate(&zs, band->last ? Z_FINISH : Z_SYNC_FLUSH);
+        band->ok = band->last ? (status == Z_STREAM_END) : (status == Z_OK && zs.avail_in == 0 && zs.avail_out > 0);
+        band->outlen = band->start + (bound - zs.avail_out);
+    }
 
-    return 1;
+    deflateEnd(&zs);
+    free(filtered);
+    return band->ok;
 }
 
-void pushRow(float *row, int width) {
-    png_byte pix[APT_IMG_WIDTH];
-    for (int i = 0; i < width; i++) pix[i] = row[i];
+int writeImage(char *filename, int width, int height, int bpp, const unsigned char *pixels, char *desc, int jobs) {
+    size_t size = (size_t)height * (width * bpp + 1);
+    int nbands = MAX(MIN(jobs, (int)(size / BAND_MIN)), 1);
+    nbands = MIN(nbands, MAX(height, 1));
 
-    png_write_row(rt_png_ptr, (png_bytep)pix);
-}
+    band_t *bands = (band_t *)calloc(nbands, sizeof(band_t));
+    if (bands == NULL) {
+        error_noexit("Could not create a PNG writer");
+        return 0;
+    }
+    for (int i = 0; i < nbands; i++) {
+        bands[i] = (band_t){.pixels = pixels, .width = width, .bpp = bpp, .begin = (int)((long)height * i / nbands),
+                            .end = (int)((long)height * (i + 1) / nbands), .last = (i == nbands - 1), .start = (i == 0) ? 2 : 0};
+    }
+
+#ifdef APT_HAVE_THREADS
+    // Bands that can't get a thread are deflated on this one, which takes the first
+    thrd_t *threads = (thrd_t *)calloc(nbands, sizeof(thrd_t));
+    int *started = (int *)calloc(nbands, sizeof(int));
+    for (int i = 1; i < nbands && threads != NULL && started != NULL; i++) {
+        started[i] = (thrd_create(&threads[i], deflateBand, &bands[i]) == thrd_success);
+    }
+    deflateBand(&bands[0]);
+    for (int i = 1; i < nbands; i++) {
+        if (started != NULL && started[i]) {
+            thrd_join(threads[i], NULL);
+        } else {
+            deflateBand(&bands[i]);
+        }
+    }
+    free(threads);
+    free(started);
+#else
+    for (int i = 0; i < nbands; i++) deflateBand(&bands[i]);
+#endif
+
+    int ok = 1;
+    uLong adler = 0;
+    for (int i = 0; i < nbands; i++) {
+        ok = ok && bands[i].ok;
+        adler = (i == 0) ? bands[i].adler : adler32_combine(adler, bands[i].adler, bands[i].len);
+    }
+
+    FILE *pngfile = ok ? fopen(filename, "wb") : NULL;
+    if (ok && pngfile == NULL) {
+        error_noexit("Could not open PNG for writing");
+        ok = 0;
+    } else if (!ok) {
+        error_noexit("Could not deflate the image");
+    }
+
+    if (ok) {
+        printf("Writing %s\n", filename);
+        writeHeader(pngfile, width, height, bpp, desc);
+
+        // Deflate, 32K window, default level
+        bands[0].out[0] = 0x78;
+        bands[0].out[1] = 0x9c;
+        put32(&bands[nbands - 1].out[bands[nbands - 1].outlen], adler);
+        bands[nbands - 1].outlen += 4;
+
+        for (int i = 0; i < nbands; i++) {
+            for (size_t done = 0; done < bands[i].outlen; done += IDAT_SIZE) {
+                writeChunk(pngfile, "IDAT", &bands[i].out[done], MIN(bands[i].outlen - done, IDAT_SIZE));
+            }
+        }
+        writeChunk(pngfile, "IEND", NULL, 0);
+
+        ok = !ferror(pngfile);
+        ok = (fclose(pngfile) == 0) && ok;
+        if (!ok) error_noexit("Could not write PNG");
+    }
 
-void closeWriter() {
-    png_write_end(rt_png_ptr, rt_info_ptr);
-    fclose(rt_pngfile);
-    png_destroy_write_struct(&rt_png_ptr, &rt_info_ptr);
+    for (int i = 0; i < nbands; i++) free(bands[i].out);
+    free(bands);
+    return ok;
 }
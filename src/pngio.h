@@ -1,11 +1,23 @@
 #include "apt.h"
 #include "common.h"
 
-int readRawImage(char *filename, float **prow, int *nrow);
+int readRawImage(char *filename, apt_image_t *img);
 int readPalette(char *filename, apt_rgb_t **pixels);
-void prow2crow(float **prow, int nrow, char *palette, apt_rgb_t **crow);
-int applyUserPalette(float **prow, int nrow, char *filename, apt_rgb_t **crow);
-int ImageOut(options_t *opts, apt_image_t *img, int offset, int width, char *desc, char chid, char *palette);
-int initWriter(options_t *opts, apt_image_t *img, int width, int height, char *desc, char *chid);
-void pushRow(float *row, int width);
-void closeWriter();
+void prow2crow(apt_image_t *img, char *palette, apt_rgb_t **crow);
+int applyUserPalette(apt_image_t *img, char *filename, apt_rgb_t **crow);
+// Write image chid of img, deflated on up to jobs threads (see writeImage). Returns 0 if it couldn't be written.
+int ImageOut(options_t *opts, apt_image_t *img, int offset, int width, char *desc, char chid, char *palette, int jobs);
+
+// Name of the file image chid of img is written to, at least 512 bytes
+void imageFilename(char *filename, options_t *opts, apt_image_t *img, char chid);
+
+// PNG written a row (of width pixels) at a time, so the image doesn't have to be kept. Rows are coloured through
+// palette unless it is NULL and gamma corrected, as ImageOut does. closeWriter returns 0 if the file couldn't be written.
+typedef struct writer writer_t;
+writer_t *initWriter(char *filename, int width, char *desc, char *palette, float gamma);
+void pushRow(writer_t *writer, const float *row);
+int closeWriter(writer_t *writer);
+
+// PNG of a whole image of 8 bit greyscale (bpp 1) or RGB (bpp 3) pixels, deflated in bands on up to jobs threads.
+// Returns 0 if the file couldn't be written.
+int writeImage(char *filename, int width, int height, int bpp, const unsigned char *pixels, char *desc, int jobs);
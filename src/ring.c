@@ -0,0 +1,139 @@
+/*
+ * aptdec - A lightweight FOSS (NOAA) APT decoder
+ * Copyright (C) 2019-2022 Xerbo (xerbo@protonmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int mirror_init(mirror_t *m, size_t size, size_t mirror) {
+    size_t n = 1;
+    while (n < size || n < mirror) n *= 2;
+
+    m->buf = (float *)malloc((n + mirror) * sizeof(float));
+    if (m->buf == NULL) return 0;
+    m->size = n;
+    m->mirror = mirror;
+    m->read = 0;
+    m->write = 0;
+
+    return 1;
+}
+
+void mirror_free(mirror_t *m) { free(m->buf); }
+
+// Anything written to the start of the buffer is also copied after the end
+void mirror_commit(mirror_t *m, size_t count) {
+    size_t start = m->write & (m->size - 1);
+    if (start < m->mirror) {
+        size_t end = (start + count < m->mirror) ? start + count : m->mirror;
+        memcpy(&m->buf[m->size + start], &m->buf[start], (end - start) * sizeof(float));
+    }
+    m->write += count;
+}
+
+#ifdef APT_HAVE_THREADS
+#include <threads.h>
+
+int ring_init(ring_t *ring, size_t size) {
+    size_t n = 1;
+    while (n < size) n *= 2;
+
+    ring->buf = (float *)malloc(n * sizeof(float));
+    if (ring->buf == NULL) return 0;
+    ring->size = n;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+
+    return 1;
+}
+
+void ring_free(ring_t *ring) { free(ring->buf); }
+
+size_t ring_write(ring_t *ring, const float *data, size_t count) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    // Indices are never wrapped, only their difference matters
+    size_t n = ring->size - (head - tail);
+    if (count < n) n = count;
+
+    // Copy in up to two parts, either side of the end of the buffer
+    size_t start = head & (ring->size - 1);
+    size_t first = ring->size - start;
+    if (first > n) first = n;
+    memcpy(&ring->buf[start], data, first * sizeof(float));
+    memcpy(ring->buf, &data[first], (n - first) * sizeof(float));
+
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+    return n;
+}
+
+size_t ring_read(ring_t *ring, float *data, size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    size_t n = head - tail;
+    if (count < n) n = count;
+
+    size_t start = tail & (ring->size - 1);
+    size_t first = ring->size - start;
+    if (first > n) first = n;
+    memcpy(data, &ring->buf[start], first * sizeof(float));
+    memcpy(&data[first], ring->buf, (n - first) * sizeof(float));
+
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    return n;
+}
+
+void ring_close(ring_t *ring) { atomic_store_explicit(&ring->closed, 1, memory_order_release); }
+
+size_t ring_write_all(ring_t *ring, const float *data, size_t count) {
+    size_t n = 0;
+    while (n < count) {
+        size_t res = ring_write(ring, &data[n], count - n);
+        if (res == 0) {
+            if (atomic_load_explicit(&ring->closed, memory_order_acquire)) break;
+            thrd_yield();
+        }
+        n += res;
+    }
+
+    return n;
+}
+
+size_t ring_read_all(ring_t *ring, float *data, size_t count) {
+    size_t n = 0;
+    while (n < count) {
+        size_t res = ring_read(ring, &data[n], count - n);
+        if (res == 0) {
+            // Check for more data after seeing closed, as it may have been written just before
+            if (atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+                res = ring_read(ring, &data[n], count - n);
+                if (res == 0) break;
+            } else {
+                thrd_yield();
+            }
+        }
+        n += res;
+    }
+
+    return n;
+}
+#endif
@@ -0,0 +1,96 @@
+/*
+ * aptdec - A lightweight FOSS (NOAA) APT decoder
+ * Copyright (C) 2019-2022 Xerbo (xerbo@protonmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef APTDEC_RING_H
+#define APTDEC_RING_H
+#include <stddef.h>
+
+/* Power of 2 circular buffer of floats for a single thread, used to queue
+ * samples between the stages of the decoder. The first `mirror` elements are
+ * repeated after the end of the buffer, so the oldest `mirror` floats can
+ * always be read as one contiguous window (to run a filter over) and nothing
+ * is ever moved to make space.
+ */
+typedef struct {
+    float *buf;  // size + mirror floats
+    size_t size;
+    size_t mirror;
+    size_t read;  // Never wrapped, only (index & (size - 1)) is used to access buf
+    size_t write;
+} mirror_t;
+
+// size is rounded up to a power of 2 no smaller than mirror, returns 0 on failure
+int mirror_init(mirror_t *m, size_t size, size_t mirror);
+void mirror_free(mirror_t *m);
+
+// Number of floats that can be read
+static inline size_t mirror_count(const mirror_t *m) { return m->write - m->read; }
+
+// Oldest float in the buffer, followed by at least MIN(mirror_count(m), m->mirror) contiguous floats
+static inline float *mirror_data(const mirror_t *m) { return &m->buf[m->read & (m->size - 1)]; }
+static inline void mirror_consume(mirror_t *m, size_t count) { m->read += count; }
+
+// Contiguous space that can be written at mirror_tail(), before calling mirror_commit()
+static inline size_t mirror_space(const mirror_t *m) {
+    size_t space = m->size - mirror_count(m);
+    size_t end = m->size - (m->write & (m->size - 1));
+    return (space < end) ? space : end;
+}
+static inline float *mirror_tail(const mirror_t *m) { return &m->buf[m->write & (m->size - 1)]; }
+void mirror_commit(mirror_t *m, size_t count);
+
+// Threads and atomics are optional in C11, the build defines APT_HAVE_THREADS when they're there and everything that
+// needs them is left out without them
+#ifdef APT_HAVE_THREADS
+#include <stdatomic.h>
+
+/* Bounded single producer, single consumer queue of floats. Reads and writes
+ * never take a lock, each side only stores its own index (with release
+ * ordering) and loads the other one (with acquire ordering). The indices are
+ * kept on separate cache lines so the two threads don't fight over them.
+ */
+typedef struct {
+    float *buf;
+    size_t size;  // Power of 2
+    char pad0[64];
+    atomic_size_t head;  // Written by the producer
+    char pad1[64];
+    atomic_size_t tail;  // Written by the consumer
+    char pad2[64];
+    atomic_int closed;
+} ring_t;
+
+// size is rounded up to a power of 2, returns 0 on failure
+int ring_init(ring_t *ring, size_t size);
+void ring_free(ring_t *ring);
+
+// Copy as much as fits/is available without waiting, returning the number of floats copied
+size_t ring_write(ring_t *ring, const float *data, size_t count);
+size_t ring_read(ring_t *ring, float *data, size_t count);
+
+// No more data will be written (or wanted), readers get everything that is left and then 0
+void ring_close(ring_t *ring);
+
+// Blocking versions, waiting (by yielding to other threads) until all count floats are copied.
+// ring_write_all gives up once the ring is closed, which lets the consumer stop a producer early.
+// ring_read_all only returns less than count once the ring is closed and empty.
+size_t ring_write_all(ring_t *ring, const float *data, size_t count);
+size_t ring_read_all(ring_t *ring, float *data, size_t count);
+
+#endif
+#endif
@@ -75,6 +75,17 @@ static const float low_pass[] = {
     -5.27511e-04, -1.78544e-04, -3.96418e-04, -8.80292e-06, -3.37279e-04};
 #define LOW_PASS_SIZE (sizeof(low_pass) / sizeof(low_pass[0]))
 
+// Halfband low pass used to decimate high sample rate inputs by 2, 19 taps (Kaiser window, beta 7)
+// with less than 0.04% ripple below 0.1 and 74dB of attenuation above 0.4 of the input sample rate
+static const float halfband_filter[] = {0.000209812, 0.0, -0.0043181, 0.0, 0.0215588, 0.0, -0.0733301, 0.0, 0.305842, 0.500075,
+                                        0.305842,    0.0, -0.0733301, 0.0, 0.0215588, 0.0, -0.0043181, 0.0, 0.000209812};
+#define HALFBAND_FILTER_SIZE (sizeof(halfband_filter) / sizeof(halfband_filter[0]))
+
 static const float sync_pattern[] = {-14, -14, -14, 18, 18, -14, -14, 18, 18, -14, -14, 18, 18, -14, -14, 18,
                                      18,  -14, -14, 18, 18, -14, -14, 18, 18, -14, -14, 18, 18, -14, -14, -14};
 #define SYNC_PATTERN_SIZE (sizeof(sync_pattern) / sizeof(sync_pattern[0]))
+
+// Seven cycles of the 832Hz sync B tone, 3px high and 2px low, starting at the first high pixel
+static const float sync_b_pattern[] = {12, 12, 12, -18, -18, 12, 12, 12, -18, -18, 12, 12, 12, -18, -18, 12, 12, 12,
+                                       -18, -18, 12, 12, 12, -18, -18, 12, 12, 12, -18, -18, 12, 12, 12, -18, -18};
+#define SYNC_B_PATTERN_SIZE (sizeof(sync_b_pattern) / sizeof(sync_b_pattern[0]))